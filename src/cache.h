@@ -0,0 +1,130 @@
+//The layout of the disk cache in ~/.wip24/cache/, which wip24 writes and
+//wip24-pack and wip24-replay read. Every file is stored once in objects/ under
+//the hash of its contents and index.txt maps keys to objects with one line per
+//entry: the hash, the size, the time of the last access, the time the object
+//was stored and the key. index.lock is locked while the index is rewritten.
+#ifndef CACHE_H
+#define CACHE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pwd.h>
+
+typedef struct {
+    uint64_t hash;
+    size_t size;
+    long long access;
+    long long created;
+    char* key;
+} wip24_index_line;
+
+static inline const char* get_home_dir() {
+    char* res = getenv("HOME");
+    if (!res) res = getpwuid(getuid())->pw_dir;
+    return res;
+}
+
+static inline void get_cache_dir(char* dest, size_t size) {
+    snprintf(dest, size, "%s/.wip24/cache", get_home_dir());
+}
+
+static inline void get_cache_object_path(char* dest, size_t size, const char* cache_dir,
+                                         uint64_t hash) {
+    snprintf(dest, size, "%s/objects/%016" PRIx64, cache_dir, hash);
+}
+
+static inline void get_object_filename(char* dest, size_t size, uint64_t hash) {
+    char cache_dir[4096];
+    get_cache_dir(cache_dir, sizeof(cache_dir));
+    get_cache_object_path(dest, size, cache_dir, hash);
+}
+
+//Parses a line of the index in place, returning false if it is malformed. The
+//key points into line.
+static inline bool parse_index_line(char* line, wip24_index_line* res) {
+    int key_start = -1;
+    if (sscanf(line, "%" SCNx64 " %zu %lld %lld %n", &res->hash, &res->size, &res->access,
+               &res->created, &key_start) != 4 || key_start<0)
+        return false;
+    res->key = line + key_start;
+    res->key[strcspn(res->key, "\n")] = 0;
+    return *res->key;
+}
+
+//Returns the length of the line, which does not fit into dest if it is size or
+//more.
+static inline int format_index_line(char* dest, size_t size, const wip24_index_line* line) {
+    return snprintf(dest, size, "%016" PRIx64 " %zu %lld %lld %s\n", line->hash, line->size,
+                    line->access, line->created, line->key);
+}
+
+//Takes the lock that is held while the index is read and rewritten, returning
+//the file to pass to unlock_cache_index(), which may be NULL.
+static inline FILE* lock_cache_index(const char* cache_dir) {
+    char filename[4096+16];
+    snprintf(filename, sizeof(filename), "%s/index.lock", cache_dir);
+    FILE* lock_file = fopen(filename, "a");
+    if (lock_file) while (lockf(fileno(lock_file), F_LOCK, 0)<0 && errno==EINTR);
+    return lock_file;
+}
+
+static inline void unlock_cache_index(FILE* lock_file) {
+    if (!lock_file) return;
+    lockf(fileno(lock_file), F_ULOCK, 0);
+    fclose(lock_file);
+}
+
+static inline char* read_file(const char* filename, size_t* size) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    *size = len>0 ? len : 0;
+    char* data = len>=0 ? malloc(*size ? *size : 1) : NULL;
+    if (data && fread(data, 1, *size, file)!=*size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+//Creates a temporary file next to filename. Once written it is moved into
+//place with commit_temp_file() so that readers never see a partial file.
+static inline FILE* create_temp_file(const char* filename, char* temp_file,
+                                     size_t temp_file_size) {
+    snprintf(temp_file, temp_file_size, "%s.XXXXXX", filename);
+    int fd = mkstemp(temp_file);
+    if (fd < 0) return NULL;
+    FILE* file = fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        remove(temp_file);
+    }
+    return file;
+}
+
+static inline bool commit_temp_file(FILE* file, const char* temp_file, const char* filename,
+                                    bool ok) {
+    ok = !fclose(file) && ok;
+    if (!ok || rename(temp_file, filename)<0) {
+        remove(temp_file);
+        return false;
+    }
+    return true;
+}
+
+static inline bool write_file_atomic(const char* filename, const void* data, size_t size) {
+    char temp_file[4096+8];
+    FILE* file = create_temp_file(filename, temp_file, sizeof(temp_file));
+    if (!file) return false;
+    return commit_temp_file(file, temp_file, filename, !size || fwrite(data, size, 1, file)==1);
+}
+#endif
@@ -0,0 +1,160 @@
+//Exports the wip24 cache to a pack and imports packs into ~/.wip24/packs/. This
+//only does file I/O, so unlike the screensaver it does not need a display.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "pack.h"
+#include "cache.h"
+
+typedef struct {
+    char* key;
+    uint64_t hash;
+    size_t size;
+} wip24_pack_source;
+
+//Reads the entries of the cache index whose objects exist, holding the lock
+//wip24 takes while it writes the index.
+static wip24_pack_source* read_cache_index(size_t* count) {
+    char cache_dir[4096];
+    get_cache_dir(cache_dir, sizeof(cache_dir));
+    FILE* lock_file = lock_cache_index(cache_dir);
+    
+    char filename[4096+16];
+    snprintf(filename, sizeof(filename), "%s/index.txt", cache_dir);
+    FILE* file = fopen(filename, "r");
+    wip24_pack_source* sources = NULL;
+    *count = 0;
+    char line[8192];
+    while (file && fgets(line, sizeof(line), file)) {
+        wip24_index_line parsed;
+        char object[4096];
+        if (!parse_index_line(line, &parsed)) continue;
+        get_object_filename(object, sizeof(object), parsed.hash);
+        if (access(object, R_OK) < 0) continue;
+        wip24_pack_source source = {strdup(parsed.key), parsed.hash, parsed.size};
+        sources = realloc(sources, (*count+1)*sizeof(wip24_pack_source));
+        sources[(*count)++] = source;
+    }
+    if (file) fclose(file);
+    
+    unlock_cache_index(lock_file);
+    return sources;
+}
+
+static int compare_sources(const void* a, const void* b) {
+    return strcmp(((const wip24_pack_source*)a)->key, ((const wip24_pack_source*)b)->key);
+}
+
+static bool write_padding(FILE* file, size_t* offset) {
+    static const char zero[PACK_ALIGNMENT];
+    size_t count = (PACK_ALIGNMENT-*offset%PACK_ALIGNMENT) % PACK_ALIGNMENT;
+    *offset += count;
+    return !count || fwrite(zero, count, 1, file)==1;
+}
+
+//Writes every entry of the cache into a pack.
+static bool export_pack(const char* filename) {
+    size_t count;
+    wip24_pack_source* entries = read_cache_index(&count);
+    if (count) qsort(entries, count, sizeof(wip24_pack_source), &compare_sources);
+    
+    wip24_pack_header header = {PACK_MAGIC, PACK_VERSION, count};
+    wip24_pack_entry* pack_entries = calloc(count+1, sizeof(wip24_pack_entry));
+    size_t offset = sizeof(header) + count*sizeof(wip24_pack_entry);
+    for (size_t i = 0; i < count; i++) {
+        pack_entries[i].key_offset = offset;
+        pack_entries[i].key_size = strlen(entries[i].key);
+        offset += pack_entries[i].key_size + 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        offset += (PACK_ALIGNMENT-offset%PACK_ALIGNMENT) % PACK_ALIGNMENT;
+        pack_entries[i].data_offset = offset;
+        pack_entries[i].data_size = entries[i].size;
+        offset += entries[i].size;
+    }
+    
+    char temp_file[4096+8];
+    FILE* file = create_temp_file(filename, temp_file, sizeof(temp_file));
+    bool ok = file != NULL;
+    if (ok) {
+        ok = fwrite(&header, sizeof(header), 1, file)==1 &&
+             (!count || fwrite(pack_entries, sizeof(wip24_pack_entry)*count, 1, file)==1);
+        offset = sizeof(header) + count*sizeof(wip24_pack_entry);
+        for (size_t i = 0; i<count && ok; i++) {
+            ok = fwrite(entries[i].key, pack_entries[i].key_size+1, 1, file) == 1;
+            offset += pack_entries[i].key_size + 1;
+        }
+        for (size_t i = 0; i<count && ok; i++) {
+            char object[4096];
+            get_object_filename(object, sizeof(object), entries[i].hash);
+            size_t size;
+            char* data = read_file(object, &size);
+            ok = write_padding(file, &offset) && data && size==entries[i].size &&
+                 (!size || fwrite(data, size, 1, file)==1);
+            if (!ok) fprintf(stderr, "Unable to write %s to the pack\n", entries[i].key);
+            offset += size;
+            free(data);
+        }
+        ok = commit_temp_file(file, temp_file, filename, ok);
+    }
+    
+    if (ok) printf("Exported %zu entries to %s\n", count, filename);
+    else fprintf(stderr, "Unable to export a pack to %s\n", filename);
+    for (size_t i = 0; i < count; i++) free(entries[i].key);
+    free(entries);
+    free(pack_entries);
+    return ok;
+}
+
+//Validates a pack and copies it into ~/.wip24/packs/ where it is loaded from.
+static bool import_pack(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat buf;
+    void* mapping = MAP_FAILED;
+    if (fd>=0 && fstat(fd, &buf)==0 && buf.st_size>0)
+        mapping = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (fd >= 0) close(fd);
+    if (mapping==MAP_FAILED || !is_valid_pack(mapping, buf.st_size)) {
+        fprintf(stderr, "Unable to import %s: not a valid pack\n", filename);
+        if (mapping != MAP_FAILED) munmap(mapping, buf.st_size);
+        return false;
+    }
+    
+    char dest[4096];
+    snprintf(dest, sizeof(dest), "%s/.wip24", get_home_dir());
+    mkdir(dest, S_IRWXU);
+    strncat(dest, "/packs", sizeof(dest)-strlen(dest)-1);
+    mkdir(dest, S_IRWXU);
+    
+    const char* name = strrchr(filename, '/');
+    name = name ? name+1 : filename;
+    size_t len = strlen(dest);
+    snprintf(dest+len, sizeof(dest)-len, "/%s", name);
+    len = strlen(dest);
+    if (len<5 || strcmp(dest+len-5, ".w24p")) strncat(dest, ".w24p", sizeof(dest)-len-1);
+    
+    char temp_file[4096+8];
+    FILE* file = create_temp_file(dest, temp_file, sizeof(temp_file));
+    bool ok = file && commit_temp_file(file, temp_file, dest,
+                                       fwrite(mapping, buf.st_size, 1, file)==1);
+    const wip24_pack_header* header = mapping;
+    if (ok) printf("Imported %" PRIu64 " entries to %s\n", header->entry_count, dest);
+    else fprintf(stderr, "Unable to import %s to %s\n", filename, dest);
+    munmap(mapping, buf.st_size);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if (argc==3 && !strcmp(argv[1], "-export")) return export_pack(argv[2]) ? 0 : 1;
+    if (argc==3 && !strcmp(argv[1], "-import")) return import_pack(argv[2]) ? 0 : 1;
+    fprintf(stderr, "Usage: %s -export pack | -import pack\n", argv[0]);
+    return 1;
+}
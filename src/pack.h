@@ -0,0 +1,46 @@
+//A pack is a single file holding cache entries that is mapped and read in
+//place. The entries are sorted by key so that they can be binary searched and
+//their data is aligned so that decoded images can be used directly. It is
+//written by wip24-pack and read by wip24.
+#ifndef PACK_H
+#define PACK_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PACK_MAGIC 0x50343257 /*"W24P"*/
+#define PACK_VERSION 1
+#define PACK_ALIGNMENT 16
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t entry_count;
+} wip24_pack_header;
+
+typedef struct {
+    uint64_t key_offset;
+    uint64_t key_size;
+    uint64_t data_offset;
+    uint64_t data_size;
+} wip24_pack_entry;
+
+//Checks that the header and every entry of a pack lie within it.
+static inline bool is_valid_pack(const void* data, size_t size) {
+    const wip24_pack_header* header = data;
+    if (size<sizeof(wip24_pack_header) || header->magic!=PACK_MAGIC ||
+        header->version!=PACK_VERSION ||
+        header->entry_count>(size-sizeof(wip24_pack_header))/sizeof(wip24_pack_entry))
+        return false;
+    
+    const wip24_pack_entry* entries = (const wip24_pack_entry*)(header+1);
+    for (size_t i = 0; i < header->entry_count; i++) {
+        const wip24_pack_entry* entry = entries + i;
+        if (entry->key_offset>=size || entry->key_size>=size-entry->key_offset ||
+            ((const char*)data)[entry->key_offset+entry->key_size] ||
+            entry->data_offset>size || entry->data_size>size-entry->data_offset)
+            return false;
+    }
+    return true;
+}
+#endif
@@ -0,0 +1,181 @@
+//Serves a recorded wip24 cache over HTTP so that the fetch path can be tested
+//and benchmarked without shadertoy.com. Point wip24 at it with
+//-endpoint http://127.0.0.1:<port>.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "cache.h"
+
+static char cache_dir[4096];
+static int port = 8024;
+static unsigned int latency = 0;
+static unsigned long bandwidth = 0;
+
+static uint64_t get_time() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*(uint64_t)1000000000 + t.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec t = {ns/1000000000, ns%1000000000};
+    while (nanosleep(&t, &t)<0 && errno==EINTR);
+}
+
+//Request paths map to the keys wip24 stores them under.
+static void get_key(char* dest, size_t size, const char* path) {
+    const char* shaders = "/api/v1/shaders/";
+    if (!strncmp(path, shaders, strlen(shaders)))
+        snprintf(dest, size, "shaders/%s", path+strlen(shaders));
+    else
+        snprintf(dest, size, "images%s", path);
+}
+
+//Finds the object of a key in the index. It is read for every request so that
+//the cache can be refilled while the server is running.
+static bool find_object(const char* key, char* filename, size_t size) {
+    char index[4096+16];
+    snprintf(index, sizeof(index), "%s/index.txt", cache_dir);
+    FILE* file = fopen(index, "r");
+    if (!file) return false;
+    
+    bool found = false;
+    char line[8192];
+    while (!found && fgets(line, sizeof(line), file)) {
+        wip24_index_line parsed;
+        if (!parse_index_line(line, &parsed) || strcmp(parsed.key, key)) continue;
+        get_cache_object_path(filename, size, cache_dir, parsed.hash);
+        found = true;
+    }
+    fclose(file);
+    return found;
+}
+
+static bool send_all(int fd, const char* data, size_t size) {
+    while (size) {
+        ssize_t res = send(fd, data, size, MSG_NOSIGNAL);
+        if (res<0 && errno==EINTR) continue;
+        if (res <= 0) return false;
+        data += res;
+        size -= res;
+    }
+    return true;
+}
+
+//Sends the body in tenth of a second chunks when the bandwidth is limited.
+static bool send_body(int fd, const char* data, size_t size) {
+    if (!bandwidth) return send_all(fd, data, size);
+    size_t chunk = bandwidth/10 ? bandwidth/10 : 1;
+    uint64_t next = get_time();
+    for (size_t offset = 0; offset < size; offset += chunk) {
+        uint64_t now = get_time();
+        if (next > now) sleep_ns(next-now);
+        next += (uint64_t)chunk * 1000000000 / bandwidth;
+        if (!send_all(fd, data+offset, size-offset<chunk ? size-offset : chunk)) return false;
+    }
+    return true;
+}
+
+static void* serve(void* userdata) {
+    int fd = (intptr_t)userdata;
+    uint64_t start = get_time();
+    
+    char request[8192] = "";
+    size_t request_size = 0;
+    while (request_size<sizeof(request)-1 && !strstr(request, "\r\n\r\n")) {
+        ssize_t res = recv(fd, request+request_size, sizeof(request)-request_size-1, 0);
+        if (res<0 && errno==EINTR) continue;
+        if (res <= 0) goto end;
+        request_size += res;
+        request[request_size] = 0;
+    }
+    
+    char method[16], path[4096];
+    if (sscanf(request, "%15s %4095s", method, path) != 2) goto end;
+    path[strcspn(path, "?")] = 0;
+    
+    char key[4096+16];
+    char filename[8192];
+    char* data = NULL;
+    size_t size = 0;
+    get_key(key, sizeof(key), path);
+    if (!strcmp(method, "GET") && find_object(key, filename, sizeof(filename)))
+        data = read_file(filename, &size);
+    
+    if (latency) sleep_ns(latency*(uint64_t)1000000);
+    
+    char header[256];
+    if (data) {
+        snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n"
+                                         "Connection: close\r\n\r\n", size);
+    } else {
+        snprintf(header, sizeof(header), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                                         "Connection: close\r\n\r\n");
+    }
+    bool ok = send_all(fd, header, strlen(header)) && (!data || send_body(fd, data, size));
+    
+    printf("%s %s %d %zu %.1fms%s\n", method, path, data?200:404, data?size:0,
+           (get_time()-start)/1000000.0, ok?"":" (aborted)");
+    fflush(stdout);
+    free(data);
+    
+    end:
+        close(fd);
+        return NULL;
+}
+
+int main(int argc, char** argv) {
+    get_cache_dir(cache_dir, sizeof(cache_dir));
+    
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-port") && i+1<argc) {
+            port = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-latency") && i+1<argc) {
+            latency = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-bandwidth") && i+1<argc) {
+            bandwidth = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-cache") && i+1<argc) {
+            snprintf(cache_dir, sizeof(cache_dir), "%s", argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [-port port] [-latency milliseconds] "
+                            "[-bandwidth bytes per second] [-cache directory]\n", argv[0]);
+            return 1;
+        }
+    }
+    
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (server<0 || bind(server, (struct sockaddr*)&addr, sizeof(addr))<0 || listen(server, 64)<0) {
+        fprintf(stderr, "Unable to listen on port %d: %s\n", port, strerror(errno));
+        return 1;
+    }
+    printf("Serving %s on http://127.0.0.1:%d\n", cache_dir, port);
+    fflush(stdout);
+    
+    while (true) {
+        int fd = accept(server, NULL, NULL);
+        if (fd < 0) continue;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &serve, (void*)(intptr_t)fd)) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -4,43 +4,214 @@
 #define API_KEY "ftntwN"
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
 #include <curl/curl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <utime.h>
+#include <stdatomic.h>
+#include <math.h>
 
 #include "stb_image.h"
 #include "xlockmore.h"
+#include <X11/extensions/dpms.h>
 #include "texfont.h"
 #include "json.h"
+#include "pack.h"
+#include "cache.h"
 
 #ifdef USE_GL
 typedef enum {channel_none, channel_image} wip24_channel_type;
 
+typedef struct wip24_upload wip24_upload;
+
+typedef struct wip24_texture wip24_texture;
+struct wip24_texture {
+    char* key;
+    int share_group;
+    GLuint texture;
+    bool ready;
+    bool failed;
+    wip24_upload* upload;
+    unsigned int width;
+    unsigned int height;
+    size_t size;
+    unsigned int refcount;
+    uint64_t last_use;
+    wip24_texture* next;
+};
+
 typedef struct {
     wip24_channel_type type;
-    GLuint texture;
+    wip24_texture* texture;
 } wip24_channel;
 
+#define TIMER_QUERY_COUNT 4
+#define FRAME_FENCE_MAX 3
+#define TILE_MIN_SIZE 16
+#define JITTER_MAX 1024
+#define TEMPORAL_MIN_WEIGHT 0.02f
+#define OVERLAY_WIDTH 512
+#define OVERLAY_HEIGHT 256
+#define OVERLAY_SAMPLES 128
+#define OVERLAY_INTERVAL 0.25
+#define DISPLAY_CHECK_INTERVAL 1.0
+#define HIDDEN_DELAY 250000
+
+typedef enum {load_shader, load_compile, load_inputs, load_first_draw,
+              load_stage_count} wip24_load_stage;
+
+//A label that is rendered into a texture once and then drawn with one quad per
+//frame instead of being laid out again every frame.
+typedef struct {
+    GLuint texture;
+    GLuint framebuffer;
+    int width;
+    int height;
+} wip24_cached_label;
+
 typedef struct {
     GLXContext *glx_context;
+    int share_group;
     GLuint program;
+    bool time_invariant;
+    bool rendered;
+    int width;
+    int height;
+    bool loading;
+    bool unmapped;
+    bool obscured;
+    bool display_off;
+    uint64_t display_checked;
+    uint64_t hidden_since;
+    uint64_t deadline;
+    unsigned int missed_deadlines;
+    unsigned int deadline_frames;
+    bool oml_sync;
+    double msc_period;
+    unsigned long swap_delay;
+    int swap_interval;
+    int64_t target_msc;
     wip24_channel channels[4];
+    char shader_id[8];
+    unsigned int ready_inputs;
+    uint64_t load_start;
     uint64_t start_time;
     uint64_t time_delta;
     unsigned int frame_count;
     float undersample;
     float undersamples[4];
+    float expected_undersample;
+    float pixel_cost;
+    int tile_size;
+    unsigned int tile_index;
+    uint64_t pass_time;
+    unsigned int pass_frame;
+    float jitter[2];
+    unsigned int jitter_index;
     GLuint framebuffer;
     GLuint fb_texture;
+    int fb_width;
+    int fb_height;
+    GLuint resolve_program;
+    GLuint history_framebuffer;
+    GLuint history[2];
+    unsigned int history_index;
+    int history_width;
+    int history_height;
+    bool history_valid;
+    GLuint timer_queries[TIMER_QUERY_COUNT];
+    double timer_query_pixels[TIMER_QUERY_COUNT];
+    unsigned int timer_query_first;
+    unsigned int timer_query_count;
+    uint64_t gpu_time;
+    GLsync frame_fences[FRAME_FENCE_MAX];
+    unsigned int frame_fence_index;
+    wip24_cached_label overlay;
+    wip24_cached_label label;
+    bool label_dirty;
+    uint64_t overlay_time;
+    float frame_times[OVERLAY_SAMPLES];
+    unsigned int frame_time_index;
+    uint64_t inputs_start;
+    uint64_t load_times[load_stage_count];
+    double cost_sum;
+    unsigned int cost_samples;
+    uint64_t cost_saved;
     texture_font_data* font;
     char shader_info[1024];
 } wip24_state;
 
+#define DECODED_MAGIC 0x54343257 /*"W24T"*/
+#define DECODED_VERSION 1
+#define MAX_MIP_LEVELS 16
+
+enum {decoded_vflip=1, decoded_srgb=2};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t levels;
+    uint32_t flags;
+} wip24_decoded_header;
+
+typedef struct {
+    void* mapping;
+    size_t mapping_size;
+    void* allocation;
+    unsigned int width;
+    unsigned int height;
+    unsigned int levels;
+    bool srgb;
+    const uint8_t* data;
+} wip24_image;
+
+#define UPLOAD_WORKER_MAX 4
+#define UPLOAD_SLOT_COUNT 4
+#define UPLOAD_SLOT_SIZE (8*1048576)
+
+typedef enum {upload_queued, upload_decoding, upload_decoded,
+              upload_streaming, upload_streamed, upload_failed} wip24_upload_status;
+
+struct wip24_upload {
+    wip24_texture* texture;
+    int share_group;
+    char* src;
+    char* vflip;
+    char* srgb;
+    bool mipmap;
+    unsigned int max_size;
+    uint64_t deadline;
+    atomic_bool cancelled;
+    wip24_upload_status status;
+    wip24_image image;
+    size_t size;
+    size_t uploaded;
+    bool allocated;
+    wip24_upload* next;
+};
+
+//A slot of the upload buffer holds a chunk of whole rows of a mip chain. It
+//stays owned by its upload until the GPU has finished reading it.
+typedef struct {
+    wip24_upload* upload;
+    size_t offset;
+    size_t size;
+    bool filled;
+    GLsync fence;
+} wip24_upload_slot;
+
 static const char* source_header = "uniform vec3 iResolution;\n"
                                    "uniform float iGlobalTime;\n"
                                    "uniform float iChannelTime[4];\n"
@@ -50,6 +221,7 @@ static const char* source_header = "uniform vec3 iResolution;\n"
                                    "uniform vec3 iChannelResolution[4];\n"
                                    "uniform int iFrame;\n"
                                    "uniform float iTimeDelta;\n"
+                                   "uniform vec2 iJitter;\n"
                                    "struct Channel {vec3 resolution; float time;};\n"
                                    "uniform Channel iChannel[4];\n"
                                    "uniform sampler2D iChannel0;\n"
@@ -62,17 +234,105 @@ static const char* source_header = "uniform vec3 iResolution;\n"
                                    "#define iTime iGlobalTime\n"
                                    "void main() {\n"
                                    "    gl_FragColor = vec4(vec3(0.0), 1.0);\n"
-                                   "    mainImage(gl_FragColor, gl_FragCoord.xy);\n"
+                                   "    mainImage(gl_FragColor, gl_FragCoord.xy+iJitter);\n"
                                    "    gl_FragColor.a = 1.0;\n"
                                    "}\n"
                                    "#line 1\n";
 static wip24_state *states = NULL;
+static int state_count = 0;
+static wip24_texture* textures = NULL;
+static size_t texture_cache_used = 0;
+static pthread_mutex_t upload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upload_cond = PTHREAD_COND_INITIALIZER;
+static wip24_upload* uploads = NULL;
+static GLuint upload_buffer = 0;
+static uint8_t* upload_buffer_data = NULL;
+static int upload_buffer_group = -1;
+static wip24_upload_slot upload_slots[UPLOAD_SLOT_COUNT];
+static unsigned int upload_slot_writers = 0;
+static bool texture_storage_supported = false;
+static bool timer_query_supported = false;
+static bool sync_supported = false;
+static unsigned long frame_delay = 0;
 static float undersample_max = 16.0f;
 static float shader_duration = 300.0f;
+static float texture_cache_size = 128.0f;
+static float cache_size = 1024.0f;
+static Bool prefetch = False;
+static Bool prefetch_compile = False;
+static int prefetch_jobs = 4;
+static float prefetch_rate = 0.0f;
+static Bool offline = False;
+static float fetch_timeout = 5.0f;
+static char* endpoint = NULL;
+static char* api_key = NULL;
+static char* trace_file = NULL;
+static char* metrics_file = NULL;
+static Bool overlay = False;
+static float label_duration = 0.0f;
+static Bool governor = True;
+static Bool vsync = False;
+static int frames_in_flight = 2;
+static float tile_budget = 8.0f;
+static Bool temporal = False;
+static int battery_delay = 66666;
+static float battery_undersample_max = 32.0f;
+static float battery_cost_max = 10.0f;
+static float thermal_limit = 80.0f;
+static int texture_max_size = 0;
 static XrmOptionDescRec opts[] = {{"-undersampleMax", ".undersampleMax", XrmoptionSepArg, NULL},
-                                  {"-shaderDuration", ".shaderDuration", XrmoptionSepArg, NULL}};
+                                  {"-shaderDuration", ".shaderDuration", XrmoptionSepArg, NULL},
+                                  {"-textureCacheSize", ".textureCacheSize", XrmoptionSepArg, NULL},
+                                  {"-textureMaxSize", ".textureMaxSize", XrmoptionSepArg, NULL},
+                                  {"-cacheSize", ".cacheSize", XrmoptionSepArg, NULL},
+                                  {"-prefetch", ".prefetch", XrmoptionNoArg, "True"},
+                                  {"-prefetchCompile", ".prefetchCompile", XrmoptionNoArg, "True"},
+                                  {"-prefetchJobs", ".prefetchJobs", XrmoptionSepArg, NULL},
+                                  {"-prefetchRate", ".prefetchRate", XrmoptionSepArg, NULL},
+                                  {"-offline", ".offline", XrmoptionNoArg, "True"},
+                                  {"-fetchTimeout", ".fetchTimeout", XrmoptionSepArg, NULL},
+                                  {"-endpoint", ".endpoint", XrmoptionSepArg, NULL},
+                                  {"-apiKey", ".apiKey", XrmoptionSepArg, NULL},
+                                  {"-trace", ".trace", XrmoptionSepArg, NULL},
+                                  {"-metrics", ".metrics", XrmoptionSepArg, NULL},
+                                  {"-overlay", ".overlay", XrmoptionNoArg, "True"},
+                                  {"-labelDuration", ".labelDuration", XrmoptionSepArg, NULL},
+                                  {"-governor", ".governor", XrmoptionNoArg, "True"},
+                                  {"-no-governor", ".governor", XrmoptionNoArg, "False"},
+                                  {"-batteryDelay", ".batteryDelay", XrmoptionSepArg, NULL},
+                                  {"-batteryUndersampleMax", ".batteryUndersampleMax", XrmoptionSepArg, NULL},
+                                  {"-batteryCostMax", ".batteryCostMax", XrmoptionSepArg, NULL},
+                                  {"-thermalLimit", ".thermalLimit", XrmoptionSepArg, NULL},
+                                  {"-vsync", ".vsync", XrmoptionNoArg, "True"},
+                                  {"-framesInFlight", ".framesInFlight", XrmoptionSepArg, NULL},
+                                  {"-tileBudget", ".tileBudget", XrmoptionSepArg, NULL},
+                                  {"-temporal", ".temporal", XrmoptionNoArg, "True"}};
 static argtype vars[] = {{&undersample_max, "undersampleMax", "Undersample Maximum", "16.0", t_Float},
-                         {&shader_duration, "shaderDuration", "Shader Duration", "300.0", t_Float}};
+                         {&shader_duration, "shaderDuration", "Shader Duration", "300.0", t_Float},
+                         {&texture_cache_size, "textureCacheSize", "Texture Cache Size", "128.0", t_Float},
+                         {&texture_max_size, "textureMaxSize", "Texture Maximum Size", "0", t_Int},
+                         {&cache_size, "cacheSize", "Cache Size", "1024.0", t_Float},
+                         {&prefetch, "prefetch", "Prefetch", "False", t_Bool},
+                         {&prefetch_compile, "prefetchCompile", "Prefetch Compile", "False", t_Bool},
+                         {&prefetch_jobs, "prefetchJobs", "Prefetch Jobs", "4", t_Int},
+                         {&prefetch_rate, "prefetchRate", "Prefetch Rate", "0.0", t_Float},
+                         {&offline, "offline", "Offline", "False", t_Bool},
+                         {&fetch_timeout, "fetchTimeout", "Fetch Timeout", "5.0", t_Float},
+                         {&endpoint, "endpoint", "Endpoint", "", t_String},
+                         {&api_key, "apiKey", "API Key", API_KEY, t_String},
+                         {&trace_file, "trace", "Trace", "", t_String},
+                         {&metrics_file, "metrics", "Metrics", "", t_String},
+                         {&overlay, "overlay", "Overlay", "False", t_Bool},
+                         {&label_duration, "labelDuration", "Label Duration", "0.0", t_Float},
+                         {&governor, "governor", "Governor", "True", t_Bool},
+                         {&battery_delay, "batteryDelay", "Battery Delay", "66666", t_Int},
+                         {&battery_undersample_max, "batteryUndersampleMax", "Battery Undersample Maximum", "32.0", t_Float},
+                         {&battery_cost_max, "batteryCostMax", "Battery Cost Maximum", "10.0", t_Float},
+                         {&thermal_limit, "thermalLimit", "Thermal Limit", "80.0", t_Float},
+                         {&vsync, "vsync", "Vsync", "False", t_Bool},
+                         {&frames_in_flight, "framesInFlight", "Frames In Flight", "2", t_Int},
+                         {&tile_budget, "tileBudget", "Tile Budget", "8.0", t_Float},
+                         {&temporal, "temporal", "Temporal", "False", t_Bool}};
 
 ENTRYPOINT ModeSpecOpt wip24_opts = {sizeof(opts)/sizeof(XrmOptionDescRec), opts,
                                      sizeof(vars)/sizeof(argtype), vars,
@@ -84,12 +344,6 @@ static uint64_t get_time() {
     return t.tv_sec*(uint64_t)1000000000 + t.tv_nsec;
 }
 
-static const char* get_home_dir() {
-    char* res = getenv("HOME");
-    if (!res) res = getpwuid(getuid())->pw_dir;
-    return res;
-}
-
 static void ensure_cache_dir() {
     char dir[4096];
     strcpy(dir, get_home_dir());
@@ -97,11 +351,11 @@ static void ensure_cache_dir() {
     mkdir(dir, S_IRWXU);
     strcat(dir, "/cache");
     mkdir(dir, S_IRWXU);
-    strcat(dir, "/images");
+    strcat(dir, "/objects");
     mkdir(dir, S_IRWXU);
     
     strcpy(dir, get_home_dir());
-    strcat(dir, "/.wip24/cache/shaders");
+    strcat(dir, "/.wip24/packs");
     mkdir(dir, S_IRWXU);
 }
 
@@ -127,6 +381,133 @@ static void log_entry(const char*format, ...) {
     vprintf(format, list2);
 }
 
+//Spans of the load pipeline are kept in memory when tracing and written out in
+//the Chrome trace event format, which chrome://tracing and Perfetto can show.
+#define TRACE_EVENT_MAX 65536
+#define TRACE_THREAD_MAX 256
+
+typedef struct {
+    const char* name;
+    char* detail;
+    unsigned int thread;
+    uint64_t start;
+    uint64_t end;
+} wip24_trace_event;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static wip24_trace_event* trace_events = NULL;
+static size_t trace_event_count = 0;
+static uint64_t trace_start = 0;
+static const char* trace_thread_names[TRACE_THREAD_MAX];
+static unsigned int trace_thread_count = 0;
+static _Thread_local unsigned int trace_thread = 0;
+
+static bool is_tracing() {
+    return trace_file && *trace_file;
+}
+
+static unsigned int get_trace_thread() {
+    if (!trace_thread) {
+        pthread_mutex_lock(&trace_mutex);
+        trace_thread = ++trace_thread_count;
+        pthread_mutex_unlock(&trace_mutex);
+    }
+    return trace_thread;
+}
+
+//Names the calling thread in the trace. name has to stay valid.
+static void set_trace_thread_name(const char* name) {
+    if (!is_tracing()) return;
+    unsigned int thread = get_trace_thread();
+    if (thread < TRACE_THREAD_MAX) trace_thread_names[thread] = name;
+}
+
+//Returns the start of a span, which is then passed to trace_end().
+static uint64_t trace_begin() {
+    return is_tracing() ? get_time() : 0;
+}
+
+static void trace_end(const char* name, const char* detail, uint64_t start) {
+    if (!start || !is_tracing()) return;
+    uint64_t end = get_time();
+    unsigned int thread = get_trace_thread();
+    
+    pthread_mutex_lock(&trace_mutex);
+    if (!trace_events) {
+        trace_events = malloc(TRACE_EVENT_MAX*sizeof(wip24_trace_event));
+        trace_start = start;
+    }
+    if (trace_events && trace_event_count<TRACE_EVENT_MAX) {
+        wip24_trace_event* event = trace_events + trace_event_count++;
+        event->name = name;
+        event->detail = detail ? strdup(detail) : NULL;
+        event->thread = thread;
+        event->start = start<trace_start ? trace_start : start;
+        event->end = end;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+//Metrics are plain atomic counters so that keeping them costs the render loop
+//and the workers nothing noticeable. A thread periodically writes them to a
+//file in the Prometheus text format.
+#define METRICS_SCREEN_MAX 16
+#define METRICS_INTERVAL 5
+
+static const double frame_time_buckets[] = {0.008, 0.016, 0.033, 0.05, 0.1, 0.25, 0.5, 1.0};
+#define FRAME_TIME_BUCKETS (sizeof(frame_time_buckets)/sizeof(frame_time_buckets[0]))
+
+typedef struct {
+    atomic_uint_fast64_t frame_time_buckets[FRAME_TIME_BUCKETS+1];
+    atomic_uint_fast64_t frame_time_sum;
+    atomic_uint_fast64_t gpu_time_sum;
+    atomic_uint_fast64_t gpu_time_count;
+    atomic_uint_fast64_t gpu_time;
+    atomic_uint_fast64_t missed_deadlines;
+    _Atomic float undersample;
+} wip24_screen_metrics;
+
+static wip24_screen_metrics screen_metrics[METRICS_SCREEN_MAX];
+static atomic_int metrics_screen_count;
+static atomic_uint_fast64_t cache_hits;
+static atomic_uint_fast64_t cache_misses;
+static atomic_uint_fast64_t pack_hits;
+static atomic_uint_fast64_t bytes_downloaded;
+static atomic_uint_fast64_t compile_time_sum;
+static atomic_uint_fast64_t compile_count;
+static atomic_uint_fast64_t shaders_loaded;
+static atomic_uint_fast64_t shaders_failed;
+
+static void metric_add(atomic_uint_fast64_t* counter, uint64_t amount) {
+    atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
+}
+
+static wip24_screen_metrics* get_screen_metrics(int screen) {
+    return screen<METRICS_SCREEN_MAX ? screen_metrics+screen : NULL;
+}
+
+static void record_frame_metrics(int screen, uint64_t frame_time, float undersample) {
+    wip24_screen_metrics* metrics = get_screen_metrics(screen);
+    if (!metrics) return;
+    size_t bucket = 0;
+    while (bucket<FRAME_TIME_BUCKETS && frame_time/1000000000.0>frame_time_buckets[bucket]) bucket++;
+    metric_add(metrics->frame_time_buckets+bucket, 1);
+    metric_add(&metrics->frame_time_sum, frame_time);
+    atomic_store_explicit(&metrics->undersample, undersample, memory_order_relaxed);
+}
+
+static void record_gpu_time(int screen, uint64_t gpu_time) {
+    wip24_screen_metrics* metrics = get_screen_metrics(screen);
+    if (!metrics) return;
+    metric_add(&metrics->gpu_time_sum, gpu_time);
+    metric_add(&metrics->gpu_time_count, 1);
+    atomic_store_explicit(&metrics->gpu_time, gpu_time, memory_order_relaxed);
+}
+
+static uint64_t load_counter(atomic_uint_fast64_t* counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
 typedef struct {
     size_t data_size;
     char* data;
@@ -134,6 +515,7 @@ typedef struct {
 
 static size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
     write_callback_data* data = userdata;
+    metric_add(&bytes_downloaded, size*nmemb);
     
     data->data = realloc(data->data, data->data_size+size*nmemb);
     
@@ -143,27 +525,309 @@ static size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdat
     return size * nmemb;
 }
 
-static void read_data(const char* base_url, void** data, size_t* size) {
-    CURL* handle = curl_easy_init();
+//Spaces out the start of transfers when a request rate limit is set.
+static void wait_for_request_slot() {
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    static uint64_t next_request = 0;
+    if (prefetch_rate <= 0.0f) return;
+    
+    pthread_mutex_lock(&mutex);
+    uint64_t now = get_time();
+    uint64_t slot = next_request>now ? next_request : now;
+    next_request = slot + 1000000000.0/prefetch_rate;
+    pthread_mutex_unlock(&mutex);
+    
+    if (slot > now) {
+        struct timespec t = {(slot-now)/1000000000, (slot-now)%1000000000};
+        while (nanosleep(&t, &t)<0 && errno==EINTR);
+    }
+}
+
+#define OFFLINE_FAILURES 3
+#define OFFLINE_DURATION 600
+#define BACKOFF_MIN 5
+#define BACKOFF_MAX 600
+#define BACKOFF_HOST_MAX 16
+#define CONNECT_TIMEOUT 5000
+#define PREFETCH_TIMEOUT 120
+#define PREFETCH_ATTEMPTS 4
+#define SHADER_FETCH_FRAMES 60
+#define INPUT_WAIT 2.0
+
+//Every transfer has to finish before its deadline and is aborted early when
+//whatever it was for is no longer needed. A transfer that waits for the network
+//is delayed until its host is no longer backed off and offline mode has ended
+//instead of being refused. network_failed is set if a transfer could not be
+//made or failed because of the network rather than the data.
+typedef struct {
+    uint64_t deadline;
+    atomic_bool* cancelled;
+    bool* network_failed;
+    bool wait;
+} wip24_fetch;
+
+//Hosts that failed are not contacted again until their retry time, which
+//doubles with every failure in a row.
+typedef struct {
+    char host[256];
+    unsigned int failures;
+    time_t retry_at;
+} wip24_backoff;
+
+static pthread_mutex_t network_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int network_failures = 0;
+static time_t offline_until = 0;
+static wip24_backoff backoffs[BACKOFF_HOST_MAX];
+static size_t backoff_count = 0;
+
+static bool is_offline() {
+    pthread_mutex_lock(&network_mutex);
+    bool res = offline || time(NULL)<offline_until;
+    pthread_mutex_unlock(&network_mutex);
+    return res;
+}
+
+static void get_host(const char* url, char* host, size_t size) {
+    const char* start = strstr(url, "://");
+    start = start ? start+3 : url;
+    size_t len = strcspn(start, "/?");
+    len = len<size ? len : size-1;
+    memcpy(host, start, len);
+    host[len] = 0;
+}
+
+static wip24_backoff* find_backoff(const char* host, bool create) {
+    for (size_t i = 0; i < backoff_count; i++)
+        if (!strcmp(backoffs[i].host, host)) return backoffs + i;
+    if (!create || backoff_count==BACKOFF_HOST_MAX) return NULL;
+    wip24_backoff* backoff = backoffs + backoff_count++;
+    strncpy(backoff->host, host, sizeof(backoff->host)-1);
+    backoff->failures = 0;
+    backoff->retry_at = 0;
+    return backoff;
+}
+
+//Returns whether a host, or any host when host is NULL, is being backed off.
+static bool is_backing_off(const char* host) {
+    pthread_mutex_lock(&network_mutex);
+    bool res = false;
+    time_t now = time(NULL);
+    for (size_t i = 0; i < backoff_count; i++)
+        if ((!host || !strcmp(backoffs[i].host, host)) && now<backoffs[i].retry_at) res = true;
+    pthread_mutex_unlock(&network_mutex);
+    return res;
+}
+
+//Returns when a transfer to a host is allowed again after backing off or
+//switching to offline mode.
+static time_t get_retry_time(const char* host) {
+    pthread_mutex_lock(&network_mutex);
+    time_t res = offline_until;
+    wip24_backoff* backoff = find_backoff(host, false);
+    if (backoff && backoff->retry_at>res) res = backoff->retry_at;
+    pthread_mutex_unlock(&network_mutex);
+    return res;
+}
+
+//Sleeps until a transfer to a host is allowed again, returning false if that
+//is past the deadline or the transfer was cancelled in the meantime.
+static bool wait_for_network(const char* host, const wip24_fetch* fetch) {
+    time_t retry_at;
+    while ((retry_at = get_retry_time(host)) > time(NULL)) {
+        if (get_time()+(retry_at-time(NULL))*(uint64_t)1000000000 > fetch->deadline) return false;
+        if (fetch->cancelled && atomic_load(fetch->cancelled)) return false;
+        sleep(1);
+    }
+    return true;
+}
+
+//Backs off from a host after a failed transfer and switches to offline mode
+//for a while after several transfers in a row were unable to reach a server.
+static void record_transfer_result(const char* host, bool unreachable, bool failed) {
+    pthread_mutex_lock(&network_mutex);
+    if (unreachable) {
+        if (++network_failures >= OFFLINE_FAILURES) {
+            network_failures = 0;
+            offline_until = time(NULL) + OFFLINE_DURATION;
+            log_entry("Going offline for %d seconds after %d failed connections\n",
+                      OFFLINE_DURATION, OFFLINE_FAILURES);
+        }
+    } else {
+        network_failures = 0;
+    }
+    
+    wip24_backoff* backoff = find_backoff(host, failed);
+    if (backoff && failed) {
+        unsigned int shift = backoff->failures<7 ? backoff->failures : 7;
+        int delay = BACKOFF_MIN << shift;
+        delay = delay>BACKOFF_MAX ? BACKOFF_MAX : delay;
+        backoff->failures++;
+        backoff->retry_at = time(NULL) + delay;
+        log_entry("Backing off from %s for %d seconds\n", host, delay);
+    } else if (backoff) {
+        backoff->failures = 0;
+        backoff->retry_at = 0;
+    }
+    pthread_mutex_unlock(&network_mutex);
+}
+
+//Transfers from every screen and worker thread share DNS results and TLS
+//sessions so that only the first request to a host pays for them. Connections
+//are not shared since libcurl does not support sharing them between transfers
+//that run at the same time. Instead every thread keeps one easy handle, and
+//with it its connections, and resets it between transfers. Threads that only
+//run one transfer are handed the handle of the thread that started them. Every
+//access is exclusive since libcurl may modify shared data while holding a lock
+//it asked for as shared.
+static CURLSH* curl_share = NULL;
+static pthread_mutex_t curl_share_locks[CURL_LOCK_DATA_LAST];
+static pthread_key_t curl_handle_key;
+
+static void lock_curl_share(CURL* handle, curl_lock_data data, curl_lock_access access,
+                            void* userdata) {
+    pthread_mutex_lock(curl_share_locks+data);
+}
+
+static void unlock_curl_share(CURL* handle, curl_lock_data data, void* userdata) {
+    pthread_mutex_unlock(curl_share_locks+data);
+}
+
+static void free_curl_handle(void* handle) {
+    curl_easy_cleanup(handle);
+}
+
+//Returns the easy handle of the calling thread, reset to its defaults.
+static CURL* get_curl_handle() {
+    CURL* handle = pthread_getspecific(curl_handle_key);
+    if (handle) {
+        curl_easy_reset(handle);
+        return handle;
+    }
+    handle = curl_easy_init();
+    pthread_setspecific(curl_handle_key, handle);
+    return handle;
+}
+
+static void init_curl_share() {
+    pthread_key_create(&curl_handle_key, &free_curl_handle);
+    curl_share = curl_share_init();
+    if (!curl_share) {
+        log_entry("Unable to create a curl share object\n");
+        return;
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_init(curl_share_locks+i, NULL);
+    curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, &lock_curl_share);
+    curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, &unlock_curl_share);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+//Upload workers may still be using the share object at exit, in which case it
+//is left alone.
+static void release_curl_share() {
+    CURL* handle = pthread_getspecific(curl_handle_key);
+    if (handle) {
+        curl_easy_cleanup(handle);
+        pthread_setspecific(curl_handle_key, NULL);
+    }
+    if (!curl_share || curl_share_cleanup(curl_share)!=CURLSHE_OK) return;
+    curl_share = NULL;
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_destroy(curl_share_locks+i);
+}
+
+static int transfer_progress(void* userdata, curl_off_t dltotal, curl_off_t dlnow,
+                             curl_off_t ultotal, curl_off_t ulnow) {
+    const wip24_fetch* fetch = userdata;
+    if (fetch->cancelled && atomic_load(fetch->cancelled)) return 1;
+    return get_time() > fetch->deadline;
+}
+
+static bool perform_transfer(CURL* handle, const char* url, curl_write_callback callback,
+                             void* userdata, const wip24_fetch* fetch) {
+    char host[256];
+    get_host(url, host, sizeof(host));
+    if (fetch->network_failed) *fetch->network_failed = true;
+    if (fetch->wait && !offline) wait_for_network(host, fetch);
+    if (is_offline()) {
+        log_entry("Not reading from %s while offline\n", url);
+        return false;
+    }
+    if (is_backing_off(host)) {
+        log_entry("Not reading from %s while backing off\n", url);
+        return false;
+    }
     
-    char* url = calloc(1, strlen(base_url)+9);
-    strcat(url, "https://");
-    strcat(url, base_url);
+    wait_for_request_slot();
+    uint64_t now = get_time();
+    if (now >= fetch->deadline) {
+        log_entry("Not reading from %s past its deadline\n", url);
+        return false;
+    }
+    long timeout = (fetch->deadline-now) / 1000000;
+    timeout = timeout<1 ? 1 : timeout;
+    
+    if (!handle) {
+        log_entry("Unable to create a curl handle\n");
+        return false;
+    }
     curl_easy_setopt(handle, CURLOPT_URL, url);
     log_entry("Reading from %s\n", url);
-    free(url);
     
-    write_callback_data cb_data;
-    cb_data.data_size = 0;
-    cb_data.data = NULL;
-    curl_easy_setopt(handle, CURLOPT_WRITEDATA, &cb_data);
-    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &write_callback);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, userdata);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, callback);
     curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, (long)1);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, (long)1);
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, timeout<CONNECT_TIMEOUT ? timeout : (long)CONNECT_TIMEOUT);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, timeout);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, (long)512);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, (long)10);
+    curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, &transfer_progress);
+    curl_easy_setopt(handle, CURLOPT_XFERINFODATA, (void*)fetch);
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, (long)0);
+    if (curl_share) curl_easy_setopt(handle, CURLOPT_SHARE, curl_share);
     
+    uint64_t start = trace_begin();
     CURLcode res = curl_easy_perform(handle);
-    curl_easy_cleanup(handle);
-    if (res != CURLE_OK) {
+    trace_end("fetch", url, start);
+    long status = 0;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+    double connect_time = 0.0;
+    curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME, &connect_time);
+    
+    //A transfer that connected but missed its deadline only means that the host
+    //is slow, which must not switch the whole process to offline mode.
+    bool cancelled = res==CURLE_ABORTED_BY_CALLBACK && fetch->cancelled &&
+                     atomic_load(fetch->cancelled);
+    bool missed_deadline = (res==CURLE_ABORTED_BY_CALLBACK && !cancelled) ||
+                           (res==CURLE_OPERATION_TIMEDOUT && connect_time>0.0);
+    bool unreachable = res==CURLE_COULDNT_RESOLVE_HOST || res==CURLE_COULDNT_CONNECT ||
+                       (res==CURLE_OPERATION_TIMEDOUT && !missed_deadline);
+    bool failed = unreachable || missed_deadline || res==CURLE_GOT_NOTHING ||
+                  res==CURLE_RECV_ERROR || (res==CURLE_OK && status>=500);
+    if (!cancelled) record_transfer_result(host, unreachable, failed);
+    
+    if (cancelled) {
+        log_entry("Cancelled reading from %s\n", url);
+        if (fetch->network_failed) *fetch->network_failed = false;
+        return false;
+    } else if (res != CURLE_OK) {
         log_entry("Error while reading: %s\n", curl_easy_strerror(res));
+        return false;
+    } else if (status >= 500) {
+        log_entry("Error while reading: server returned %ld\n", status);
+        return false;
+    }
+    if (fetch->network_failed) *fetch->network_failed = false;
+    return true;
+}
+
+static void read_data(const char* url, void** data, size_t* size,
+                      const wip24_fetch* fetch) {
+    write_callback_data cb_data;
+    cb_data.data_size = 0;
+    cb_data.data = NULL;
+    if (!perform_transfer(get_curl_handle(), url, &write_callback, &cb_data, fetch)) {
+        free(cb_data.data);
         *data = NULL;
         *size = 0;
     } else {
@@ -172,168 +836,1658 @@ static void read_data(const char* base_url, void** data, size_t* size) {
     }
 }
 
-static const char* pick_shader_id() {
-    char filename[4096];
-    snprintf(filename, sizeof(filename), "%s/.wip24/shaders.txt", get_home_dir());
-    FILE* file = fopen(filename, "r");
-    if (!file) return NULL;
-    
-    static char ids[4096][8];
-    size_t id_count = 0;
-    while (id_count<4096) {
-        char id[8] = {0};
-        int c;
-        while ((c=fgetc(file)) != '\n') {
-            if (c == EOF) goto end;
-            if (strlen(id)<7) id[strlen(id)] = c;
-        }
-        
-        if (id[0] != '#') strcpy(ids[id_count++], id);
+//Shaders and images are read from shadertoy.com unless another endpoint is set,
+//which may be a mirror, a local replay server or a file:// directory laid out
+//like the site.
+static void get_shader_url(char* dest, size_t size, const char* id) {
+    const char* base = endpoint && *endpoint ? endpoint : "https://www.shadertoy.com";
+    if (!strncmp(base, "file://", 7) || !api_key || !*api_key)
+        snprintf(dest, size, "%s/api/v1/shaders/%s", base, id);
+    else
+        snprintf(dest, size, "%s/api/v1/shaders/%s?key=%s", base, id, api_key);
+}
+
+static void get_media_url(char* dest, size_t size, const char* src) {
+    snprintf(dest, size, "%s%s", endpoint && *endpoint ? endpoint : "https://shadertoy.com", src);
+}
+
+static void write_json_string(FILE* file, const char* str) {
+    fputc('"', file);
+    for (; *str; str++) {
+        if (*str=='"' || *str=='\\') fprintf(file, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20) fprintf(file, "\\u%04x", (unsigned char)*str);
+        else fputc(*str, file);
     }
-    end:
-        ;
-    fclose(file);
-    
-    if (!id_count) return NULL;
-    
-    return ids[ya_random()%id_count];
+    fputc('"', file);
 }
 
-static void load_texture(wip24_channel* channel, const char* src,
-                         const char* filter, const char* wrap,
-                         const char* vflip, const char* srgb) {
-    glDeleteTextures(1, &channel->texture);
-    
-    char cached_file[4096] = {0};
-    snprintf(cached_file, sizeof(cached_file), "%s/.wip24/cache/images/", get_home_dir());
-    for (const char* c = src; *c && strlen(cached_file)+1<sizeof(cached_file); c++)
-        cached_file[strlen(cached_file)] = *c=='/' ? '_' : *c;
-    FILE* cached = fopen(cached_file, "rb");
-    if (!cached) {
-        char url[2048];
-        snprintf(url, sizeof(url), "shadertoy.com%s", src);
-        void* img_data;
-        size_t img_data_size;
-        read_data(url, &img_data, &img_data_size);
-        if (!img_data) goto error;
-        
-        cached = fopen(cached_file, "wb");
-        fwrite(img_data, img_data_size, 1, cached);
-        free(img_data);
+//Rewrites the whole trace, so it can be called whenever there is something new
+//to look at.
+static void write_trace() {
+    if (!is_tracing()) return;
+    char temp_file[4096+8];
+    FILE* file = create_temp_file(trace_file, temp_file, sizeof(temp_file));
+    if (!file) {
+        log_entry("Unable to write the trace to %s\n", trace_file);
+        return;
     }
-    fclose(cached);
     
-    int w, h, comp;
-    stbi_uc* data = stbi_load(cached_file, &w, &h, &comp, 4);
-    if (!data) {
-        log_entry("Unable to load %s: %s\n", cached_file, stbi_failure_reason());
-        goto error;
+    pthread_mutex_lock(&trace_mutex);
+    long long pid = getpid();
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lld,\"tid\":0,"
+                  "\"args\":{\"name\":\"wip24\"}}", pid);
+    for (unsigned int i = 1; i<=trace_thread_count && i<TRACE_THREAD_MAX; i++) {
+        if (!trace_thread_names[i]) continue;
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lld,\"tid\":%u,"
+                      "\"args\":{\"name\":\"%s\"}}", pid, i, trace_thread_names[i]);
     }
-    
-    if (!strcmp(vflip, "true")) {
-        for (unsigned int y = 0; y < h; y++) {
-            for (unsigned int x = 0; x < w; x++) {
-                int temp = ((int*)data)[y*w+x];
-                ((int*)data)[y*w+x] = ((int*)data)[(h-y-1)*w+x];
-                ((int*)data)[(h-y-1)*w+x] = temp;
-            }
+    for (size_t i = 0; i < trace_event_count; i++) {
+        const wip24_trace_event* event = trace_events + i;
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"load\",\"ph\":\"X\",\"pid\":%lld,"
+                      "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", event->name, pid, event->thread,
+                (event->start-trace_start)/1000.0, (event->end-event->start)/1000.0);
+        if (event->detail) {
+            fprintf(file, ",\"args\":{\"detail\":");
+            write_json_string(file, event->detail);
+            fputc('}', file);
         }
+        fputc('}', file);
     }
+    fprintf(file, "\n]}\n");
+    pthread_mutex_unlock(&trace_mutex);
     
-    GLuint texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+    if (!commit_temp_file(file, temp_file, trace_file, !ferror(file)))
+        log_entry("Unable to write the trace to %s\n", trace_file);
+}
+
+static void write_metric_header(FILE* file, const char* name, const char* type,
+                                const char* help) {
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void write_metrics() {
+    char temp_file[4096+8];
+    FILE* file = create_temp_file(metrics_file, temp_file, sizeof(temp_file));
+    if (!file) {
+        log_entry("Unable to write metrics to %s\n", metrics_file);
+        return;
+    }
+    int screens = atomic_load(&metrics_screen_count);
     
-    if (!strcmp(filter, "mipmap")) {
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    } else if (!strcmp(filter, "linear")) {
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    } else {
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    write_metric_header(file, "wip24_frame_seconds", "histogram",
+                        "Time taken to draw and present a frame.");
+    for (int i = 0; i < screens; i++) {
+        wip24_screen_metrics* metrics = screen_metrics + i;
+        uint64_t total = 0;
+        for (size_t j = 0; j <= FRAME_TIME_BUCKETS; j++) {
+            total += load_counter(metrics->frame_time_buckets+j);
+            if (j < FRAME_TIME_BUCKETS)
+                fprintf(file, "wip24_frame_seconds_bucket{screen=\"%d\",le=\"%g\"} %"PRIu64"\n",
+                        i, frame_time_buckets[j], total);
+        }
+        fprintf(file, "wip24_frame_seconds_bucket{screen=\"%d\",le=\"+Inf\"} %"PRIu64"\n", i, total);
+        fprintf(file, "wip24_frame_seconds_sum{screen=\"%d\"} %.6f\n", i,
+                load_counter(&metrics->frame_time_sum)/1000000000.0);
+        fprintf(file, "wip24_frame_seconds_count{screen=\"%d\"} %"PRIu64"\n", i, total);
     }
     
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, strcmp(wrap, "repeat")?GL_CLAMP_TO_EDGE:GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, strcmp(wrap, "repeat")?GL_CLAMP_TO_EDGE:GL_REPEAT);
+    write_metric_header(file, "wip24_gpu_seconds", "summary",
+                        "GPU time taken to render the shader.");
+    for (int i = 0; i < screens; i++) {
+        fprintf(file, "wip24_gpu_seconds_sum{screen=\"%d\"} %.6f\n", i,
+                load_counter(&screen_metrics[i].gpu_time_sum)/1000000000.0);
+        fprintf(file, "wip24_gpu_seconds_count{screen=\"%d\"} %"PRIu64"\n", i,
+                load_counter(&screen_metrics[i].gpu_time_count));
+    }
+    write_metric_header(file, "wip24_gpu_last_seconds", "gauge",
+                        "GPU time taken to render the shader in the last measured frame.");
+    for (int i = 0; i < screens; i++)
+        fprintf(file, "wip24_gpu_last_seconds{screen=\"%d\"} %.6f\n", i,
+                load_counter(&screen_metrics[i].gpu_time)/1000000000.0);
+    write_metric_header(file, "wip24_missed_deadlines_total", "counter",
+                        "Frames that finished after the next one should have started.");
+    for (int i = 0; i < screens; i++)
+        fprintf(file, "wip24_missed_deadlines_total{screen=\"%d\"} %"PRIu64"\n", i,
+                load_counter(&screen_metrics[i].missed_deadlines));
+    write_metric_header(file, "wip24_undersample", "gauge",
+                        "Factor the shader resolution is currently divided by.");
+    for (int i = 0; i < screens; i++)
+        fprintf(file, "wip24_undersample{screen=\"%d\"} %g\n", i,
+                atomic_load_explicit(&screen_metrics[i].undersample, memory_order_relaxed));
     
-    glTexImage2D(GL_TEXTURE_2D, 0, strcmp(srgb, "true")?GL_RGBA:GL_SRGB8_ALPHA8,
-                 w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-    stbi_image_free(data);
+    write_metric_header(file, "wip24_cache_lookups_total", "counter",
+                        "Disk cache and pack lookups.");
+    fprintf(file, "wip24_cache_lookups_total{result=\"hit\"} %"PRIu64"\n", load_counter(&cache_hits));
+    fprintf(file, "wip24_cache_lookups_total{result=\"miss\"} %"PRIu64"\n", load_counter(&cache_misses));
+    fprintf(file, "wip24_cache_lookups_total{result=\"pack\"} %"PRIu64"\n", load_counter(&pack_hits));
+    write_metric_header(file, "wip24_downloaded_bytes_total", "counter", "Bytes downloaded.");
+    fprintf(file, "wip24_downloaded_bytes_total %"PRIu64"\n", load_counter(&bytes_downloaded));
+    write_metric_header(file, "wip24_compile_seconds", "summary",
+                        "Time taken to compile and link shaders.");
+    fprintf(file, "wip24_compile_seconds_sum %.6f\n", load_counter(&compile_time_sum)/1000000000.0);
+    fprintf(file, "wip24_compile_seconds_count %"PRIu64"\n", load_counter(&compile_count));
+    write_metric_header(file, "wip24_shaders_total", "counter",
+                        "Shaders that were loaded or could not be displayed.");
+    fprintf(file, "wip24_shaders_total{result=\"loaded\"} %"PRIu64"\n", load_counter(&shaders_loaded));
+    fprintf(file, "wip24_shaders_total{result=\"failed\"} %"PRIu64"\n", load_counter(&shaders_failed));
     
-    channel->texture = texture;
-    channel->type = channel_image;
-    return;
-    error:
-        channel->texture = 0;
-        channel->type = channel_none;
+    commit_temp_file(file, temp_file, metrics_file, !ferror(file));
 }
 
-static void clear_shader(wip24_state* state) {
-    glDeleteProgram(state->program);
-    state->program = 0;
-    for (unsigned int i = 0; i < 4; i++) {
-        glDeleteTextures(1, &state->channels[i].texture);
-        state->channels[i].type = channel_none;
+static void* metrics_writer(void* userdata) {
+    set_trace_thread_name("metrics");
+    while (true) {
+        write_metrics();
+        sleep(METRICS_INTERVAL);
     }
+    return NULL;
 }
 
-static void set_shader_source(wip24_state* state, const char* source) {
-    GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
-    
-    const char* sources[2] = {source_header, source};
-    glShaderSource(frag, 2, sources, NULL);
-    glCompileShader(frag);
-    GLint status;
-    glGetShaderiv(frag, GL_COMPILE_STATUS, &status);
-    if (!status) {
-        char log[1024];
-        glGetShaderInfoLog(frag, sizeof(log), NULL, log);
-        log_entry("Error: Unable to compile shader: %s\n", log);
-        glDeleteShader(frag);
+static void start_metrics_writer() {
+    if (!metrics_file || !*metrics_file) return;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &metrics_writer, NULL)) {
+        log_entry("Unable to create the metrics thread\n");
         return;
     }
-    
-    state->program = glCreateProgram();
-    glAttachShader(state->program, frag);
-    glLinkProgram(state->program);
-    glValidateProgram(state->program);
-    glDeleteShader(frag);
-    glGetProgramiv(state->program, GL_LINK_STATUS, &status);
-    if (!status) {
-        char log[1024];
-        glGetProgramInfoLog(state->program, sizeof(log), NULL, log);
-        log_entry("Error: Unable to link program: %s\n", log);
-        glDeleteProgram(state->program);
-        state->program = 0;
-        return;
+    pthread_detach(thread);
+}
+
+//The cache stores every file as an object named after the hash of its contents
+//so that identical files stored under different keys are only kept once. The
+//index maps keys to objects and records when they were last used so that the
+//least recently used ones can be evicted once the cache exceeds its budget.
+//It is shared with other processes by merging it with the file on disk under
+//a lock whenever it is flushed, which a background thread does every
+//CACHE_FLUSH_INTERVAL seconds while it has changed and once more at exit.
+#define CACHE_FLUSH_INTERVAL 30
+
+typedef struct {
+    char* key;
+    uint64_t hash;
+    size_t size;
+    time_t access;
+    time_t created;
+} wip24_cache_entry;
+
+typedef struct {
+    uint64_t hash;
+    size_t size;
+    unsigned int refs;
+} wip24_cache_object;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cache_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static wip24_cache_entry* cache_entries = NULL;
+static size_t cache_entry_count = 0;
+static char** cache_removed = NULL;
+static size_t cache_removed_count = 0;
+static bool cache_loaded = false;
+static bool cache_dirty = false;
+
+static uint64_t hash_data(const void* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ((const uint8_t*)data)[i];
+        hash *= 1099511628211ull;
     }
+    return hash;
 }
 
-static json_value* lookup_obj(json_value* obj, const char* key) {
-    if (!obj) return NULL;
-    if (obj->type != json_object) return NULL;
-    
-    for (unsigned int i = 0; i < obj->u.object.length; i++)
-        if (!strcmp(obj->u.object.values[i].name, key))
-            return obj->u.object.values[i].value;
-    
+static wip24_cache_entry* find_cache_entry(const char* key) {
+    for (size_t i = 0; i < cache_entry_count; i++)
+        if (!strcmp(cache_entries[i].key, key)) return cache_entries + i;
     return NULL;
 }
 
-static bool set_shader_from_json(wip24_state* state, const char* json, size_t json_len) {
-    glDeleteProgram(state->program);
-    state->program = 0;
-    
-    char error[json_error_max];
-    memset(error, 0, json_error_max);
-    json_settings settings;
-    memset(&settings, 0, sizeof(settings));
-    json_value* root = json_parse_ex(&settings, json, json_len, error);
-    if (!root) {
-        log_entry("Unable to parse JSON: %s\n", error);
-        goto error;
-    }
+static wip24_cache_entry* add_cache_entry(const char* key) {
+    cache_entries = realloc(cache_entries, (cache_entry_count+1)*sizeof(wip24_cache_entry));
+    wip24_cache_entry* entry = cache_entries + cache_entry_count++;
+    memset(entry, 0, sizeof(wip24_cache_entry));
+    entry->key = strdup(key);
+    cache_dirty = true;
+    return entry;
+}
+
+static void remove_cache_entry(wip24_cache_entry* entry) {
+    cache_removed = realloc(cache_removed, (cache_removed_count+1)*sizeof(char*));
+    cache_removed[cache_removed_count++] = entry->key;
+    *entry = cache_entries[--cache_entry_count];
+    cache_dirty = true;
+}
+
+static bool was_cache_entry_removed(const char* key) {
+    for (size_t i = 0; i < cache_removed_count; i++)
+        if (!strcmp(cache_removed[i], key)) return true;
+    return false;
+}
+
+//Merges the index on disk into the in-memory one. Entries that this process
+//removed since the last flush are not brought back.
+static void read_cache_index(FILE* file) {
+    char line[8192];
+    while (fgets(line, sizeof(line), file)) {
+        wip24_index_line parsed;
+        if (!parse_index_line(line, &parsed) || was_cache_entry_removed(parsed.key)) continue;
+        
+        wip24_cache_entry* entry = find_cache_entry(parsed.key);
+        if (!entry) {
+            entry = add_cache_entry(parsed.key);
+        } else if (entry->created >= parsed.created) {
+            entry->access = entry->access>parsed.access ? entry->access : parsed.access;
+            continue;
+        }
+        entry->hash = parsed.hash;
+        entry->size = parsed.size;
+        entry->access = entry->access>parsed.access ? entry->access : parsed.access;
+        entry->created = parsed.created;
+    }
+}
+
+static void load_cache_index() {
+    if (cache_loaded) return;
+    cache_loaded = true;
+    
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s/.wip24/cache/index.txt", get_home_dir());
+    FILE* file = fopen(filename, "r");
+    if (!file) return;
+    read_cache_index(file);
+    fclose(file);
+}
+
+static int compare_cache_objects(const void* a, const void* b) {
+    uint64_t hash_a = ((const wip24_cache_object*)a)->hash;
+    uint64_t hash_b = ((const wip24_cache_object*)b)->hash;
+    return hash_a<hash_b ? -1 : hash_a>hash_b;
+}
+
+static int compare_cache_entries(const void* a, const void* b) {
+    time_t access_a = ((const wip24_cache_entry*)a)->access;
+    time_t access_b = ((const wip24_cache_entry*)b)->access;
+    return access_a<access_b ? -1 : access_a>access_b;
+}
+
+//Removes the least recently used entries until the objects they refer to fit
+//in the budget, deleting objects once no entry refers to them any more.
+static void evict_cache_entries() {
+    wip24_cache_object* objects = malloc((cache_entry_count+1)*sizeof(wip24_cache_object));
+    size_t object_count = 0;
+    for (size_t i = 0; i < cache_entry_count; i++) {
+        objects[object_count].hash = cache_entries[i].hash;
+        objects[object_count].size = cache_entries[i].size;
+        objects[object_count++].refs = 1;
+    }
+    qsort(objects, object_count, sizeof(wip24_cache_object), &compare_cache_objects);
+    
+    size_t unique_count = 0;
+    size_t total = 0;
+    for (size_t i = 0; i < object_count; i++) {
+        if (unique_count && objects[unique_count-1].hash==objects[i].hash) {
+            objects[unique_count-1].refs++;
+        } else {
+            objects[unique_count++] = objects[i];
+            total += objects[i].size;
+        }
+    }
+    
+    size_t budget = cache_size * 1048576.0f;
+    if (total > budget)
+        qsort(cache_entries, cache_entry_count, sizeof(wip24_cache_entry), &compare_cache_entries);
+    while (total>budget && cache_entry_count) {
+        wip24_cache_object key = {cache_entries[0].hash, 0, 0};
+        wip24_cache_object* object = bsearch(&key, objects, unique_count,
+                                             sizeof(wip24_cache_object), &compare_cache_objects);
+        if (object && !--object->refs) {
+            char filename[4096];
+            get_object_filename(filename, sizeof(filename), object->hash);
+            remove(filename);
+            total -= object->size;
+        }
+        remove_cache_entry(cache_entries);
+        //Keep the rest sorted by moving the entry that replaced the first one.
+        if (cache_entry_count > 1) {
+            wip24_cache_entry entry = cache_entries[0];
+            memmove(cache_entries, cache_entries+1, (cache_entry_count-1)*sizeof(wip24_cache_entry));
+            cache_entries[cache_entry_count-1] = entry;
+        }
+    }
+    free(objects);
+}
+
+static int compare_hashes(const void* a, const void* b) {
+    uint64_t hash_a = *(const uint64_t*)a;
+    uint64_t hash_b = *(const uint64_t*)b;
+    return hash_a<hash_b ? -1 : hash_a>hash_b;
+}
+
+//Deletes objects that no entry refers to, such as the previous object of a key
+//that was stored again or the object of a removed entry, and temporary files
+//left behind by interrupted writes. Objects are written before their entry is
+//added to the index, possibly by another process, so they are only deleted once
+//they are CACHE_ORPHAN_AGE seconds old.
+#define CACHE_ORPHAN_AGE 3600
+
+static void sweep_cache_objects(uint64_t* hashes, size_t hash_count) {
+    qsort(hashes, hash_count, sizeof(uint64_t), &compare_hashes);
+    
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/.wip24/cache/objects", get_home_dir());
+    DIR* d = opendir(dir);
+    time_t now = time(NULL);
+    struct dirent* ent;
+    while (d && (ent = readdir(d))) {
+        char* end;
+        uint64_t hash = strtoull(ent->d_name, &end, 16);
+        if (end-ent->d_name!=16 || (*end && *end!='.')) continue;
+        if (!*end && bsearch(&hash, hashes, hash_count, sizeof(uint64_t), &compare_hashes))
+            continue;
+        
+        char filename[4096+256];
+        snprintf(filename, sizeof(filename), "%s/%s", dir, ent->d_name);
+        struct stat st;
+        if (stat(filename, &st)==0 && now-st.st_mtime>CACHE_ORPHAN_AGE) remove(filename);
+    }
+    if (d) closedir(d);
+}
+
+//Writes the index if it has changed, merging in changes made by other
+//processes, and deletes orphaned objects if sweep is set. The render thread and
+//the workers only wait for cache_mutex while the index is merged in memory.
+static void flush_cache_index(bool sweep) {
+    pthread_mutex_lock(&cache_flush_mutex);
+    pthread_mutex_lock(&cache_mutex);
+    bool dirty = cache_dirty;
+    pthread_mutex_unlock(&cache_mutex);
+    if (!dirty && !sweep) {
+        pthread_mutex_unlock(&cache_flush_mutex);
+        return;
+    }
+    
+    char cache_dir[4096];
+    get_cache_dir(cache_dir, sizeof(cache_dir));
+    FILE* lock_file = lock_cache_index(cache_dir);
+    
+    char filename[4096+16];
+    snprintf(filename, sizeof(filename), "%s/index.txt", cache_dir);
+    FILE* file = fopen(filename, "r");
+    pthread_mutex_lock(&cache_mutex);
+    load_cache_index();
+    if (file) {
+        read_cache_index(file);
+        fclose(file);
+    }
+    
+    evict_cache_entries();
+    
+    size_t size = 0;
+    char* data = NULL;
+    for (size_t i = 0; i < cache_entry_count; i++) {
+        const wip24_cache_entry* entry = cache_entries + i;
+        wip24_index_line index_line = {entry->hash, entry->size, entry->access,
+                                       entry->created, entry->key};
+        char line[8192];
+        int len = format_index_line(line, sizeof(line), &index_line);
+        if (len<0 || len>=sizeof(line)) continue;
+        data = realloc(data, size+len);
+        memcpy(data+size, line, len);
+        size += len;
+    }
+    
+    uint64_t* hashes = NULL;
+    size_t hash_count = cache_entry_count;
+    if (sweep) {
+        hashes = malloc((hash_count+1)*sizeof(uint64_t));
+        for (size_t i = 0; i < hash_count; i++) hashes[i] = cache_entries[i].hash;
+    }
+    
+    for (size_t i = 0; i < cache_removed_count; i++) free(cache_removed[i]);
+    free(cache_removed);
+    cache_removed = NULL;
+    cache_removed_count = 0;
+    cache_dirty = false;
+    pthread_mutex_unlock(&cache_mutex);
+    
+    if (!write_file_atomic(filename, data, size))
+        log_entry("Unable to write the cache index\n");
+    free(data);
+    if (sweep) sweep_cache_objects(hashes, hash_count);
+    free(hashes);
+    
+    unlock_cache_index(lock_file);
+    pthread_mutex_unlock(&cache_flush_mutex);
+}
+
+//Sweeps the cache once at startup and then flushes the index periodically.
+static void* cache_flusher(void* userdata) {
+    set_trace_thread_name("cache");
+    flush_cache_index(true);
+    while (true) {
+        sleep(CACHE_FLUSH_INTERVAL);
+        flush_cache_index(false);
+    }
+    return NULL;
+}
+
+static void start_cache_flusher() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &cache_flusher, NULL)) {
+        log_entry("Unable to create the cache thread\n");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+//Finds the object stored under a key, marking it as used. created is set to
+//the time the object was stored if it is not NULL.
+static bool cache_lookup(const char* key, char* filename, size_t filename_size,
+                         time_t* created) {
+    uint64_t start = trace_begin();
+    pthread_mutex_lock(&cache_mutex);
+    load_cache_index();
+    wip24_cache_entry* entry = find_cache_entry(key);
+    bool found = false;
+    if (entry) {
+        get_object_filename(filename, filename_size, entry->hash);
+        if (access(filename, R_OK) == 0) {
+            entry->access = time(NULL);
+            cache_dirty = true;
+            if (created) *created = entry->created;
+            found = true;
+        } else {
+            remove_cache_entry(entry);
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    trace_end(found?"cache hit":"cache miss", key, start);
+    metric_add(found?&cache_hits:&cache_misses, 1);
+    return found;
+}
+
+//Like cache_lookup() but does not count as a use of the entry and filename may
+//be NULL.
+static bool cache_contains(const char* key, char* filename, size_t filename_size) {
+    pthread_mutex_lock(&cache_mutex);
+    load_cache_index();
+    wip24_cache_entry* entry = find_cache_entry(key);
+    bool found = false;
+    if (entry) {
+        char object[4096];
+        get_object_filename(object, sizeof(object), entry->hash);
+        found = access(object, R_OK) == 0;
+        if (found && filename) snprintf(filename, filename_size, "%s", object);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return found;
+}
+
+static void cache_store(const char* key, const void* data, size_t size) {
+    uint64_t hash = hash_data(data, size);
+    char filename[4096];
+    get_object_filename(filename, sizeof(filename), hash);
+    //An existing object is touched so that it is not swept as an orphan before
+    //the entry that refers to it again is flushed.
+    if (access(filename, R_OK) == 0) {
+        utime(filename, NULL);
+    } else if (!write_file_atomic(filename, data, size)) {
+        log_entry("Unable to write cache object for %s\n", key);
+        return;
+    }
+    
+    pthread_mutex_lock(&cache_mutex);
+    load_cache_index();
+    wip24_cache_entry* entry = find_cache_entry(key);
+    if (!entry) entry = add_cache_entry(key);
+    entry->hash = hash;
+    entry->size = size;
+    entry->access = entry->created = time(NULL);
+    cache_dirty = true;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+//Images used to be cached in images/ under their src with every '/' replaced
+//by '_', which can only be undone for the directories shadertoy serves them
+//from, and shaders in shaders/ as <id>.json.
+static bool get_old_cache_key(char* key, size_t size, const char* dir, const char* name) {
+    size_t len = strlen(name);
+    const char* end;
+    if (!strcmp(dir, "shaders") && len>5 && len-5<8 && !strcmp(name+len-5, ".json"))
+        snprintf(key, size, "shaders/%.*s", (int)(len-5), name);
+    else if (!strcmp(dir, "images") && !strncmp(name, "_presets_", 9))
+        snprintf(key, size, "images/presets/%s", name+9);
+    else if (!strcmp(dir, "images") && !strncmp(name, "_media_", 7) && (end = strchr(name+7, '_')))
+        snprintf(key, size, "images/media/%.*s/%s", (int)(end-name-7), name+7, end+1);
+    else
+        return false;
+    return true;
+}
+
+//Moves the files of a directory of the cache layout from before objects were
+//introduced into objects/ and adds them to the index, keeping the time they
+//were downloaded. The directory is deleted afterwards.
+static void migrate_old_cache_dir(const char* name) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/.wip24/cache/%s", get_home_dir(), name);
+    DIR* d = opendir(dir);
+    if (!d) return;
+    size_t migrated = 0;
+    struct dirent* ent;
+    while ((ent = readdir(d))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        char filename[4096+256];
+        snprintf(filename, sizeof(filename), "%s/%s", dir, ent->d_name);
+        char key[4096];
+        struct stat st;
+        size_t size;
+        char* data = NULL;
+        if (get_old_cache_key(key, sizeof(key), name, ent->d_name) && stat(filename, &st)==0)
+            data = read_file(filename, &size);
+        if (!data) {
+            remove(filename);
+            continue;
+        }
+        
+        uint64_t hash = hash_data(data, size);
+        free(data);
+        char object[4096];
+        get_object_filename(object, sizeof(object), hash);
+        if (access(object, R_OK)<0 && rename(filename, object)<0) continue;
+        remove(filename);
+        
+        pthread_mutex_lock(&cache_mutex);
+        load_cache_index();
+        if (!find_cache_entry(key)) {
+            wip24_cache_entry* entry = add_cache_entry(key);
+            entry->hash = hash;
+            entry->size = size;
+            entry->access = entry->created = st.st_mtime;
+            migrated++;
+        }
+        pthread_mutex_unlock(&cache_mutex);
+    }
+    closedir(d);
+    rmdir(dir);
+    log_entry("Moved %zu files from %s into the cache\n", migrated, dir);
+}
+
+static void migrate_old_cache() {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/.wip24/cache/images", get_home_dir());
+    bool images = access(dir, F_OK) == 0;
+    snprintf(dir, sizeof(dir), "%s/.wip24/cache/shaders", get_home_dir());
+    if (!images && access(dir, F_OK)<0) return;
+    migrate_old_cache_dir("images");
+    migrate_old_cache_dir("shaders");
+}
+
+//Packs written by wip24-pack are mapped from ~/.wip24/packs/.
+typedef struct {
+    void* mapping;
+    size_t size;
+    const wip24_pack_entry* entries;
+    size_t entry_count;
+} wip24_pack;
+
+static wip24_pack* packs = NULL;
+static size_t pack_count = 0;
+
+static bool map_pack(wip24_pack* pack, const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat buf;
+    if (fstat(fd, &buf)<0 || buf.st_size<sizeof(wip24_pack_header)) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+    if (!is_valid_pack(mapping, buf.st_size)) {
+        log_entry("Ignoring invalid pack %s\n", filename);
+        munmap(mapping, buf.st_size);
+        return false;
+    }
+    
+    const wip24_pack_header* header = mapping;
+    pack->mapping = mapping;
+    pack->size = buf.st_size;
+    pack->entries = (const wip24_pack_entry*)(header+1);
+    pack->entry_count = header->entry_count;
+    return true;
+}
+
+static void load_packs() {
+    char dirname[4096];
+    snprintf(dirname, sizeof(dirname), "%s/.wip24/packs", get_home_dir());
+    DIR* dir = opendir(dirname);
+    if (!dir) return;
+    
+    struct dirent* ent;
+    while ((ent = readdir(dir))) {
+        size_t len = strlen(ent->d_name);
+        if (len<5 || strcmp(ent->d_name+len-5, ".w24p")) continue;
+        
+        char filename[4096+256];
+        snprintf(filename, sizeof(filename), "%s/%s", dirname, ent->d_name);
+        wip24_pack pack;
+        if (!map_pack(&pack, filename)) continue;
+        packs = realloc(packs, (pack_count+1)*sizeof(wip24_pack));
+        packs[pack_count++] = pack;
+        log_entry("Loaded pack %s with %zu entries\n", filename, pack.entry_count);
+    }
+    closedir(dir);
+}
+
+static bool pack_lookup(const char* key, const void** data, size_t* size) {
+    for (size_t i = 0; i < pack_count; i++) {
+        const wip24_pack* pack = packs + i;
+        size_t low = 0, high = pack->entry_count;
+        while (low < high) {
+            size_t mid = (low+high) / 2;
+            const wip24_pack_entry* entry = pack->entries + mid;
+            int cmp = strcmp(key, (const char*)pack->mapping+entry->key_offset);
+            if (cmp < 0) {
+                high = mid;
+            } else if (cmp > 0) {
+                low = mid + 1;
+            } else {
+                *data = (const uint8_t*)pack->mapping + entry->data_offset;
+                *size = entry->data_size;
+                metric_add(&pack_hits, 1);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//A download that is decoded while it is still arriving. The transfer runs on
+//its own thread and the decoder blocks in the stb_image callbacks until more
+//data is available.
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    write_callback_data buffer;
+    size_t read_pos;
+    bool finished;
+    bool ok;
+    bool cancelled;
+    char url[2048];
+    CURL* handle;
+    const wip24_fetch* fetch;
+} wip24_stream;
+
+static size_t stream_write_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    wip24_stream* stream = userdata;
+    pthread_mutex_lock(&stream->mutex);
+    size_t res = stream->cancelled ? 0 : write_callback(ptr, size, nmemb, &stream->buffer);
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+    return res;
+}
+
+static void* stream_transfer(void* userdata) {
+    wip24_stream* stream = userdata;
+    set_trace_thread_name("transfer");
+    bool ok = perform_transfer(stream->handle, stream->url, &stream_write_callback, stream,
+                               stream->fetch);
+    pthread_mutex_lock(&stream->mutex);
+    stream->finished = true;
+    stream->ok = ok;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+    return NULL;
+}
+
+//Waits until count bytes past the read position have arrived or the transfer
+//has finished, since stb_image treats short reads as the end of the file.
+static void stream_wait(wip24_stream* stream, size_t count) {
+    while (!stream->finished && stream->read_pos+count>stream->buffer.data_size)
+        pthread_cond_wait(&stream->cond, &stream->mutex);
+}
+
+static int stream_read(void* userdata, char* data, int size) {
+    wip24_stream* stream = userdata;
+    pthread_mutex_lock(&stream->mutex);
+    stream_wait(stream, size);
+    size_t count = 0;
+    if (stream->read_pos < stream->buffer.data_size) {
+        count = stream->buffer.data_size - stream->read_pos;
+        count = count>size ? size : count;
+        memcpy(data, stream->buffer.data+stream->read_pos, count);
+        stream->read_pos += count;
+    }
+    pthread_mutex_unlock(&stream->mutex);
+    return count;
+}
+
+static void stream_skip(void* userdata, int n) {
+    wip24_stream* stream = userdata;
+    pthread_mutex_lock(&stream->mutex);
+    stream->read_pos = n<0 && -n>stream->read_pos ? 0 : stream->read_pos+n;
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+static int stream_eof(void* userdata) {
+    wip24_stream* stream = userdata;
+    pthread_mutex_lock(&stream->mutex);
+    stream_wait(stream, 1);
+    int res = stream->read_pos >= stream->buffer.data_size;
+    pthread_mutex_unlock(&stream->mutex);
+    return res;
+}
+
+//Downloads an image into the cache while decoding it, so that the decode
+//overlaps with the transfer.
+static stbi_uc* stream_image(const char* src, const char* key, int* w, int* h,
+                             const wip24_fetch* fetch) {
+    wip24_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.handle = get_curl_handle();
+    stream.fetch = fetch;
+    pthread_mutex_init(&stream.mutex, NULL);
+    pthread_cond_init(&stream.cond, NULL);
+    get_media_url(stream.url, sizeof(stream.url), src);
+    
+    stbi_uc* data = NULL;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &stream_transfer, &stream)) {
+        log_entry("Unable to create a transfer thread\n");
+        goto end;
+    }
+    
+    static const stbi_io_callbacks callbacks = {&stream_read, &stream_skip, &stream_eof};
+    int comp;
+    data = stbi_load_from_callbacks(&callbacks, &stream, w, h, &comp, 4);
+    if (!data) log_entry("Unable to load %s: %s\n", src, stbi_failure_reason());
+    
+    pthread_mutex_lock(&stream.mutex);
+    stream.cancelled = !data;
+    pthread_mutex_unlock(&stream.mutex);
+    pthread_join(thread, NULL);
+    
+    if (data && !stream.ok) {
+        stbi_image_free(data);
+        data = NULL;
+    } else if (data) {
+        cache_store(key, stream.buffer.data, stream.buffer.data_size);
+    }
+    
+    end:
+        free(stream.buffer.data);
+        pthread_cond_destroy(&stream.cond);
+        pthread_mutex_destroy(&stream.mutex);
+        return data;
+}
+
+static size_t read_shader_ids(char ids[][8], size_t max_ids) {
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s/.wip24/shaders.txt", get_home_dir());
+    FILE* file = fopen(filename, "r");
+    if (!file) return 0;
+    
+    size_t id_count = 0;
+    while (id_count<max_ids) {
+        char id[8] = {0};
+        int c;
+        while ((c=fgetc(file)) != '\n') {
+            if (c == EOF) goto end;
+            if (strlen(id)<7) id[strlen(id)] = c;
+        }
+        
+        if (id[0] != '#') strcpy(ids[id_count++], id);
+    }
+    end:
+        ;
+    fclose(file);
+    return id_count;
+}
+
+static unsigned int mip_level_count(unsigned int w, unsigned int h) {
+    unsigned int levels = 1;
+    while ((w>1 || h>1) && levels<MAX_MIP_LEVELS) {
+        w = w>1 ? w/2 : 1;
+        h = h>1 ? h/2 : 1;
+        levels++;
+    }
+    return levels;
+}
+
+static size_t mip_level_offset(unsigned int w, unsigned int h, unsigned int level) {
+    size_t offset = 0;
+    for (unsigned int i = 0; i < level; i++) {
+        offset += (size_t)w * h * 4;
+        w = w>1 ? w/2 : 1;
+        h = h>1 ? h/2 : 1;
+    }
+    return offset;
+}
+
+static float srgb_to_linear(float v) {
+    return v<=0.04045f ? v/12.92f : powf((v+0.055f)/1.055f, 2.4f);
+}
+
+static uint8_t linear_to_srgb(float v) {
+    v = v<=0.0031308f ? v*12.92f : 1.055f*powf(v, 1.0f/2.4f)-0.055f;
+    return v<=0.0f ? 0 : v>=1.0f ? 255 : (uint8_t)(v*255.0f+0.5f);
+}
+
+//Fills in levels 1 and up of a chain whose first level is already present,
+//averaging in linear space for sRGB images so that the mips do not darken.
+static void build_mip_chain(uint8_t* chain, unsigned int w, unsigned int h,
+                            unsigned int levels, bool srgb) {
+    static pthread_mutex_t to_linear_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static float to_linear[256];
+    pthread_mutex_lock(&to_linear_mutex);
+    if (srgb && to_linear[255]==0.0f)
+        for (unsigned int i = 0; i < 256; i++) to_linear[i] = srgb_to_linear(i/255.0f);
+    pthread_mutex_unlock(&to_linear_mutex);
+    
+    const uint8_t* src = chain;
+    for (unsigned int level = 1; level < levels; level++) {
+        unsigned int dw = w>1 ? w/2 : 1;
+        unsigned int dh = h>1 ? h/2 : 1;
+        uint8_t* dest = (uint8_t*)src + (size_t)w*h*4;
+        for (unsigned int y = 0; y < dh; y++) {
+            const uint8_t* row0 = src + (size_t)(y*2<h ? y*2 : h-1)*w*4;
+            const uint8_t* row1 = src + (size_t)(y*2+1<h ? y*2+1 : h-1)*w*4;
+            for (unsigned int x = 0; x < dw; x++) {
+                unsigned int x0 = (x*2<w ? x*2 : w-1) * 4;
+                unsigned int x1 = (x*2+1<w ? x*2+1 : w-1) * 4;
+                uint8_t* out = dest + ((size_t)y*dw+x)*4;
+                for (unsigned int c = 0; c < 4; c++) {
+                    if (srgb && c<3) {
+                        float sum = to_linear[row0[x0+c]] + to_linear[row0[x1+c]] +
+                                    to_linear[row1[x0+c]] + to_linear[row1[x1+c]];
+                        out[c] = linear_to_srgb(sum*0.25f);
+                    } else {
+                        out[c] = (row0[x0+c]+row0[x1+c]+row1[x0+c]+row1[x1+c]+2) / 4;
+                    }
+                }
+            }
+        }
+        src = dest;
+        w = dw;
+        h = dh;
+    }
+}
+
+//Reads a decoded image in place. The image does not own the data.
+static bool parse_decoded_image(wip24_image* image, const void* data, size_t size,
+                                uint32_t flags) {
+    const wip24_decoded_header* header = data;
+    if (size<sizeof(wip24_decoded_header) ||
+        header->magic!=DECODED_MAGIC || header->version!=DECODED_VERSION ||
+        header->flags!=flags || !header->width || !header->height ||
+        header->levels!=mip_level_count(header->width, header->height) ||
+        size != sizeof(wip24_decoded_header)+
+                mip_level_offset(header->width, header->height, header->levels))
+        return false;
+    
+    image->mapping = NULL;
+    image->mapping_size = 0;
+    image->allocation = NULL;
+    image->width = header->width;
+    image->height = header->height;
+    image->levels = header->levels;
+    image->srgb = flags & decoded_srgb;
+    image->data = (const uint8_t*)(header+1);
+    return true;
+}
+
+static bool map_decoded_image(wip24_image* image, const char* filename, uint32_t flags) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    
+    struct stat buf;
+    if (fstat(fd, &buf) < 0) {
+        close(fd);
+        return false;
+    }
+    
+    void* mapping = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+    
+    if (!parse_decoded_image(image, mapping, buf.st_size, flags)) {
+        log_entry("Ignoring invalid decoded image %s\n", filename);
+        munmap(mapping, buf.st_size);
+        return false;
+    }
+    image->mapping = mapping;
+    image->mapping_size = buf.st_size;
+    return true;
+}
+
+static void free_image(wip24_image* image) {
+    if (image->mapping) munmap(image->mapping, image->mapping_size);
+    else free(image->allocation);
+    memset(image, 0, sizeof(wip24_image));
+}
+
+//Drops the largest levels of a mip chain until the image is no larger than
+//max_size and takes at most a quarter of the texture cache. The remaining
+//levels were box filtered when the image was decoded, so this is equivalent
+//to downscaling without doing any work.
+static void limit_image_size(wip24_image* image, unsigned int max_size) {
+    size_t budget = texture_cache_size * 1048576.0f / 4.0f;
+    unsigned int skip = 0;
+    while (skip+1 < image->levels) {
+        unsigned int w = image->width>>skip ? image->width>>skip : 1;
+        unsigned int h = image->height>>skip ? image->height>>skip : 1;
+        if ((w<=max_size && h<=max_size) &&
+            mip_level_offset(w, h, image->levels-skip)<=budget) break;
+        skip++;
+    }
+    if (!skip) return;
+    
+    image->data += mip_level_offset(image->width, image->height, skip);
+    image->width = image->width>>skip ? image->width>>skip : 1;
+    image->height = image->height>>skip ? image->height>>skip : 1;
+    image->levels -= skip;
+}
+
+//Decodes an image into a full mip chain and stores it in the cache so that
+//later loads only need to map the file.
+static bool decode_image(wip24_image* image, const char* src, const char* decoded_key,
+                         uint32_t flags, const wip24_fetch* fetch) {
+    uint64_t start = trace_begin();
+    char key[4096];
+    snprintf(key, sizeof(key), "images%s", src);
+    char cached_file[4096];
+    
+    int w, h, comp;
+    stbi_uc* data;
+    const void* packed;
+    size_t packed_size;
+    if (pack_lookup(key, &packed, &packed_size)) {
+        data = stbi_load_from_memory(packed, packed_size, &w, &h, &comp, 4);
+        if (!data) log_entry("Unable to load %s: %s\n", key, stbi_failure_reason());
+    } else if (cache_lookup(key, cached_file, sizeof(cached_file), NULL)) {
+        data = stbi_load(cached_file, &w, &h, &comp, 4);
+        if (!data) log_entry("Unable to load %s: %s\n", cached_file, stbi_failure_reason());
+    } else {
+        data = stream_image(src, key, &w, &h, fetch);
+    }
+    if (!data) {
+        trace_end("decode", src, start);
+        return false;
+    }
+    
+    unsigned int levels = mip_level_count(w, h);
+    size_t chain_size = mip_level_offset(w, h, levels);
+    wip24_decoded_header* header = malloc(sizeof(wip24_decoded_header)+chain_size);
+    header->magic = DECODED_MAGIC;
+    header->version = DECODED_VERSION;
+    header->width = w;
+    header->height = h;
+    header->levels = levels;
+    header->flags = flags;
+    uint8_t* chain = (uint8_t*)(header+1);
+    
+    size_t stride = (size_t)w * 4;
+    for (unsigned int y = 0; y < h; y++) {
+        unsigned int src_y = flags&decoded_vflip ? h-y-1 : y;
+        memcpy(chain+y*stride, data+src_y*stride, stride);
+    }
+    stbi_image_free(data);
+    build_mip_chain(chain, w, h, levels, flags&decoded_srgb);
+    trace_end("decode", src, start);
+    
+    cache_store(decoded_key, header, sizeof(wip24_decoded_header)+chain_size);
+    
+    image->mapping = NULL;
+    image->mapping_size = 0;
+    image->allocation = header;
+    image->width = w;
+    image->height = h;
+    image->levels = levels;
+    image->srgb = flags & decoded_srgb;
+    image->data = chain;
+    return true;
+}
+
+static uint32_t get_decoded_flags(const char* vflip, const char* srgb) {
+    return (strcmp(vflip, "true")?0:decoded_vflip) | (strcmp(srgb, "true")?0:decoded_srgb);
+}
+
+static void get_decoded_key(char* dest, size_t size, const char* src, uint32_t flags) {
+    snprintf(dest, size, "decoded%s.%u", src, (unsigned int)flags);
+}
+
+static bool load_image(wip24_image* image, const char* src, const char* vflip,
+                       const char* srgb, const wip24_fetch* fetch) {
+    uint32_t flags = get_decoded_flags(vflip, srgb);
+    char key[4096];
+    get_decoded_key(key, sizeof(key), src, flags);
+    char decoded_file[4096];
+    const void* packed;
+    size_t packed_size;
+    
+    if (pack_lookup(key, &packed, &packed_size) &&
+        parse_decoded_image(image, packed, packed_size, flags)) return true;
+    if (cache_lookup(key, decoded_file, sizeof(decoded_file), NULL) &&
+        map_decoded_image(image, decoded_file, flags)) return true;
+    return decode_image(image, src, key, flags, fetch);
+}
+
+//Returns whether a space separated list of extensions contains name itself
+//rather than only an extension that starts with it.
+static bool has_extension(const char* extensions, const char* name) {
+    size_t len = strlen(name);
+    for (const char* cur = extensions; cur && (cur = strstr(cur, name)); cur += len)
+        if ((cur==extensions || cur[-1]==' ') && (cur[len]==' ' || !cur[len])) return true;
+    return false;
+}
+
+static bool has_gl_extension(const char* name) {
+    return has_extension((const char*)glGetString(GL_EXTENSIONS), name);
+}
+
+static void set_texture_params(const char* filter, const char* wrap) {
+    if (!strcmp(filter, "mipmap")) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    } else if (!strcmp(filter, "linear")) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    } else {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, strcmp(wrap, "repeat")?GL_CLAMP_TO_EDGE:GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, strcmp(wrap, "repeat")?GL_CLAMP_TO_EDGE:GL_REPEAT);
+}
+
+static unsigned int get_texture_levels(const wip24_image* image, bool mipmap) {
+    return mipmap ? mip_level_count(image->width, image->height) : 1;
+}
+
+//Allocates the bound texture with exactly the levels it will be sampled with.
+//No GL_PIXEL_UNPACK_BUFFER may be bound.
+static void allocate_levels(const wip24_image* image, bool mipmap) {
+    unsigned int levels = get_texture_levels(image, mipmap);
+    GLenum format = image->srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+    
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels-1);
+    if (texture_storage_supported) {
+        glTexStorage2D(GL_TEXTURE_2D, levels, format, image->width, image->height);
+        return;
+    }
+    unsigned int w = image->width;
+    unsigned int h = image->height;
+    for (unsigned int level = 0; level < levels; level++) {
+        glTexImage2D(GL_TEXTURE_2D, level, format, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        w = w>1 ? w/2 : 1;
+        h = h>1 ? h/2 : 1;
+    }
+}
+
+//Uploads the rows of the mip chain between the byte offsets start and end,
+//which lie on row boundaries, into the bound texture. data holds the chain from
+//start on and is either client memory or an offset into the bound
+//GL_PIXEL_UNPACK_BUFFER.
+static void upload_chain_range(const wip24_image* image, size_t start, size_t end,
+                               const uint8_t* data) {
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    unsigned int w = image->width;
+    unsigned int h = image->height;
+    size_t offset = 0;
+    for (unsigned int level = 0; level<image->levels && offset<end; level++) {
+        size_t row = (size_t)w * 4;
+        size_t first = start>offset ? start : offset;
+        size_t last = end<offset+row*h ? end : offset+row*h;
+        if (first < last)
+            glTexSubImage2D(GL_TEXTURE_2D, level, 0, (first-offset)/row, w, (last-first)/row,
+                            GL_RGBA, GL_UNSIGNED_BYTE, data+(first-start));
+        offset += row * h;
+        w = w>1 ? w/2 : 1;
+        h = h>1 ? h/2 : 1;
+    }
+}
+
+//Lets the driver generate the mipmaps missing from the chain once it has been
+//uploaded.
+static void finish_levels(const wip24_image* image, bool mipmap) {
+    if (image->levels < get_texture_levels(image, mipmap)) glGenerateMipmap(GL_TEXTURE_2D);
+}
+
+//Returns the end of the chunk of a mip chain that starts at the byte offset
+//start, which is as many whole rows as fit into a slot.
+static size_t get_chunk_end(const wip24_image* image, size_t start) {
+    size_t limit = start + UPLOAD_SLOT_SIZE;
+    unsigned int w = image->width;
+    unsigned int h = image->height;
+    size_t offset = 0;
+    for (unsigned int level = 0; level < image->levels; level++) {
+        size_t row = (size_t)w * 4;
+        if (offset+row*h > limit) return limit - (limit-offset)%row;
+        offset += row * h;
+        w = w>1 ? w/2 : 1;
+        h = h>1 ? h/2 : 1;
+    }
+    return offset;
+}
+
+//Creates the ring of persistently mapped pixel buffers that the upload
+//worker decodes into. Without GL_ARB_buffer_storage and GL_ARB_sync uploads
+//are made from client memory instead.
+static void init_upload_buffer(int share_group) {
+    if (upload_buffer) return;
+    if (!has_gl_extension("GL_ARB_buffer_storage") || !has_gl_extension("GL_ARB_sync")) {
+        log_entry("Persistent pixel buffers are unsupported, uploading from client memory\n");
+        return;
+    }
+    
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &upload_buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffer);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, UPLOAD_SLOT_COUNT*UPLOAD_SLOT_SIZE, NULL, flags);
+    void* data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                                  UPLOAD_SLOT_COUNT*UPLOAD_SLOT_SIZE, flags);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!data) {
+        log_entry("Unable to map the upload buffer\n");
+        glDeleteBuffers(1, &upload_buffer);
+        upload_buffer = 0;
+        return;
+    }
+    
+    pthread_mutex_lock(&upload_mutex);
+    upload_buffer_data = data;
+    upload_buffer_group = share_group;
+    pthread_mutex_unlock(&upload_mutex);
+}
+
+static void release_upload_buffer(int share_group) {
+    if (!upload_buffer || upload_buffer_group!=share_group) return;
+    
+    pthread_mutex_lock(&upload_mutex);
+    while (upload_slot_writers) pthread_cond_wait(&upload_cond, &upload_mutex);
+    upload_buffer_data = NULL;
+    upload_buffer_group = -1;
+    for (int i = 0; i < UPLOAD_SLOT_COUNT; i++) glDeleteSync(upload_slots[i].fence);
+    memset(upload_slots, 0, sizeof(upload_slots));
+    pthread_cond_broadcast(&upload_cond);
+    pthread_mutex_unlock(&upload_mutex);
+    
+    glDeleteBuffers(1, &upload_buffer);
+    upload_buffer = 0;
+}
+
+//Waits for a free slot of the upload buffer and gives it to an upload. Returns
+//-1 if the buffer was released or the upload cancelled in the meantime. Must be
+//called with upload_mutex held.
+static int acquire_upload_slot(wip24_upload* upload) {
+    while (upload_buffer_data && upload_buffer_group==upload->share_group &&
+           !atomic_load(&upload->cancelled)) {
+        for (int i = 0; i < UPLOAD_SLOT_COUNT; i++) {
+            if (upload_slots[i].upload) continue;
+            memset(upload_slots+i, 0, sizeof(wip24_upload_slot));
+            upload_slots[i].upload = upload;
+            return i;
+        }
+        pthread_cond_wait(&upload_cond, &upload_mutex);
+    }
+    return -1;
+}
+
+static void release_upload_slot(int slot) {
+    if (upload_slots[slot].fence) glDeleteSync(upload_slots[slot].fence);
+    memset(upload_slots+slot, 0, sizeof(wip24_upload_slot));
+    pthread_cond_broadcast(&upload_cond);
+}
+
+static bool has_upload_slots(const wip24_upload* upload) {
+    for (int i = 0; i < UPLOAD_SLOT_COUNT; i++)
+        if (upload_slots[i].upload == upload) return true;
+    return false;
+}
+
+//Decodes queued uploads and streams the mip chains through the slots of the
+//upload buffer in chunks so that the render thread only has to issue copies
+//from it, however large the image is. Several workers run at once so that all
+//inputs of a shader decode in parallel.
+static void* upload_worker(void* userdata) {
+    set_trace_thread_name("upload worker");
+    pthread_mutex_lock(&upload_mutex);
+    while (true) {
+        wip24_upload* upload = NULL;
+        for (wip24_upload* cur = uploads; cur; cur = cur->next)
+            if (cur->status == upload_queued) upload = cur;
+        if (!upload) {
+            pthread_cond_wait(&upload_cond, &upload_mutex);
+            continue;
+        }
+        upload->status = upload_decoding;
+        pthread_mutex_unlock(&upload_mutex);
+        
+        wip24_image image;
+        wip24_fetch fetch = {upload->deadline, &upload->cancelled};
+        bool ok = load_image(&image, upload->src, upload->vflip, upload->srgb, &fetch);
+        if (ok) {
+            limit_image_size(&image, upload->max_size);
+            if (!upload->mipmap) image.levels = 1;
+        }
+        
+        pthread_mutex_lock(&upload_mutex);
+        if (ok) upload->image = image;
+        upload->size = ok ? mip_level_offset(image.width, image.height, image.levels) : 0;
+        if (!ok || !upload_buffer_data || upload_buffer_group!=upload->share_group) {
+            upload->status = ok ? upload_decoded : upload_failed;
+            continue;
+        }
+        
+        upload->image.mapping = NULL;
+        upload->image.allocation = NULL;
+        upload->image.data = NULL;
+        upload->status = upload_streaming;
+        size_t offset = 0;
+        int slot;
+        while (offset<upload->size && (slot = acquire_upload_slot(upload))>=0) {
+            size_t end = get_chunk_end(&image, offset);
+            upload_slots[slot].offset = offset;
+            upload_slots[slot].size = end - offset;
+            upload_slot_writers++;
+            uint8_t* dest = upload_buffer_data + (size_t)slot*UPLOAD_SLOT_SIZE;
+            pthread_mutex_unlock(&upload_mutex);
+            
+            uint64_t start = trace_begin();
+            memcpy(dest, image.data+offset, end-offset);
+            trace_end("copy", upload->src, start);
+            
+            pthread_mutex_lock(&upload_mutex);
+            upload_slot_writers--;
+            if (upload_slots[slot].upload == upload) upload_slots[slot].filled = true;
+            pthread_cond_broadcast(&upload_cond);
+            offset = end;
+        }
+        bool streamed = offset == upload->size;
+        pthread_mutex_unlock(&upload_mutex);
+        
+        free_image(&image);
+        
+        pthread_mutex_lock(&upload_mutex);
+        upload->status = streamed ? upload_streamed : upload_failed;
+    }
+    return NULL;
+}
+
+static void queue_upload(wip24_texture* texture, const char* src, const char* filter,
+                         const char* vflip, const char* srgb, unsigned int max_size) {
+    static unsigned int worker_count = 0;
+    if (!worker_count) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpus = cpus<1 ? 1 : cpus>UPLOAD_WORKER_MAX ? UPLOAD_WORKER_MAX : cpus;
+        for (long i = 0; i < cpus; i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, &upload_worker, NULL)) break;
+            pthread_detach(thread);
+            worker_count++;
+        }
+        if (!worker_count) {
+            log_entry("Unable to create an upload worker\n");
+            texture->failed = true;
+            return;
+        }
+    }
+    
+    wip24_upload* upload = calloc(1, sizeof(wip24_upload));
+    upload->texture = texture;
+    upload->share_group = texture->share_group;
+    upload->src = strdup(src);
+    upload->vflip = strdup(vflip);
+    upload->srgb = strdup(srgb);
+    upload->mipmap = !strcmp(filter, "mipmap");
+    upload->max_size = max_size;
+    //Shaders start with placeholders for inputs that have not loaded after
+    //INPUT_WAIT seconds, so an input may keep loading in the background for up
+    //to a tenth of the time the shader is shown for.
+    float timeout = shader_duration/10.0f>fetch_timeout ? shader_duration/10.0f : fetch_timeout;
+    upload->deadline = get_time() + (uint64_t)(timeout*1000000000.0);
+    atomic_init(&upload->cancelled, false);
+    upload->status = upload_queued;
+    texture->upload = upload;
+    
+    pthread_mutex_lock(&upload_mutex);
+    upload->next = uploads;
+    uploads = upload;
+    pthread_cond_broadcast(&upload_cond);
+    pthread_mutex_unlock(&upload_mutex);
+}
+
+static void free_upload(wip24_upload* upload) {
+    if (upload->texture) upload->texture->upload = NULL;
+    for (int i = 0; i < UPLOAD_SLOT_COUNT; i++)
+        if (upload_slots[i].upload == upload) release_upload_slot(i);
+    free_image(&upload->image);
+    free(upload->src);
+    free(upload->vflip);
+    free(upload->srgb);
+    free(upload);
+}
+
+//Allocates the bound texture of an upload and accounts for it in the texture
+//cache.
+static void allocate_texture(wip24_upload* upload) {
+    wip24_texture* texture = upload->texture;
+    const wip24_image* image = &upload->image;
+    texture->width = image->width;
+    texture->height = image->height;
+    texture->size = mip_level_offset(image->width, image->height,
+                                     get_texture_levels(image, upload->mipmap));
+    texture_cache_used += texture->size;
+    allocate_levels(image, upload->mipmap);
+    upload->allocated = true;
+}
+
+//Copies a filled slot into its texture and fences it so that the slot is only
+//reused once the GPU has read it.
+static void upload_chunk(int slot) {
+    wip24_upload_slot* chunk = upload_slots + slot;
+    wip24_upload* upload = chunk->upload;
+    uint64_t start = trace_begin();
+    glBindTexture(GL_TEXTURE_2D, upload->texture->texture);
+    if (!upload->allocated) allocate_texture(upload);
+    
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffer);
+    upload_chain_range(&upload->image, chunk->offset, chunk->offset+chunk->size,
+                       (const uint8_t*)(uintptr_t)((size_t)slot*UPLOAD_SLOT_SIZE));
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    upload->uploaded += chunk->size;
+    if (upload->uploaded == upload->size) finish_levels(&upload->image, upload->mipmap);
+    chunk->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    trace_end("upload", upload->src, start);
+}
+
+//Moves finished uploads of the current share group along: filled slots are
+//copied into their textures and fenced, slots whose fence has been signaled are
+//freed and textures become ready for sampling on the next frame once all of
+//their slots have been read.
+static void process_uploads(int share_group) {
+    pthread_mutex_lock(&upload_mutex);
+    for (int i = 0; i < UPLOAD_SLOT_COUNT; i++) {
+        wip24_upload_slot* chunk = upload_slots + i;
+        if (!chunk->upload || chunk->upload->share_group!=share_group) continue;
+        if (chunk->fence) {
+            GLenum res = glClientWaitSync(chunk->fence, 0, 0);
+            if (res==GL_ALREADY_SIGNALED || res==GL_CONDITION_SATISFIED) release_upload_slot(i);
+        } else if (chunk->filled && !chunk->upload->texture) {
+            release_upload_slot(i);
+        } else if (chunk->filled) {
+            upload_chunk(i);
+        }
+    }
+    
+    for (wip24_upload** cur = &uploads; *cur;) {
+        wip24_upload* upload = *cur;
+        wip24_texture* texture = upload->texture;
+        if (upload->share_group != share_group) {
+            cur = &upload->next;
+            continue;
+        }
+        
+        //An upload keeps its slots until the GPU has read them, even if its
+        //texture has been released in the meantime.
+        bool done = false;
+        if (upload->status==upload_decoded && texture) {
+            uint64_t start = trace_begin();
+            glBindTexture(GL_TEXTURE_2D, texture->texture);
+            allocate_texture(upload);
+            upload_chain_range(&upload->image, 0, upload->size, upload->image.data);
+            finish_levels(&upload->image, upload->mipmap);
+            trace_end("upload", upload->src, start);
+            texture->ready = true;
+            done = true;
+        } else if (upload->status == upload_decoded) {
+            done = true;
+        } else if ((upload->status==upload_streamed || upload->status==upload_failed) &&
+                   !has_upload_slots(upload)) {
+            if (texture && upload->status==upload_streamed) texture->ready = true;
+            else if (texture) texture->failed = true;
+            done = true;
+        }
+        
+        if (done) {
+            *cur = upload->next;
+            free_upload(upload);
+            pthread_cond_broadcast(&upload_cond);
+        } else {
+            cur = &upload->next;
+        }
+    }
+    pthread_mutex_unlock(&upload_mutex);
+}
+
+static void remove_texture(wip24_texture* texture) {
+    for (wip24_texture** cur = &textures; *cur; cur = &(*cur)->next) {
+        if (*cur == texture) {
+            *cur = texture->next;
+            break;
+        }
+    }
+    
+    pthread_mutex_lock(&upload_mutex);
+    if (texture->upload) {
+        texture->upload->texture = NULL;
+        atomic_store(&texture->upload->cancelled, true);
+        pthread_cond_broadcast(&upload_cond);
+    }
+    pthread_mutex_unlock(&upload_mutex);
+    glDeleteTextures(1, &texture->texture);
+    texture_cache_used -= texture->size;
+    free(texture->key);
+    free(texture);
+}
+
+//Deletes the least recently used unreferenced textures of a share group until
+//the cache fits in its budget. Textures of other share groups are left alone
+//since their names are meaningless in the current context.
+static void evict_textures(int share_group) {
+    size_t budget = texture_cache_size * 1048576.0f;
+    while (texture_cache_used > budget) {
+        wip24_texture* lru = NULL;
+        for (wip24_texture* cur = textures; cur; cur = cur->next) {
+            if (cur->refcount || cur->share_group!=share_group) continue;
+            if (!lru || cur->last_use<lru->last_use) lru = cur;
+        }
+        if (!lru) return;
+        remove_texture(lru);
+    }
+}
+
+static void release_texture(wip24_texture* texture) {
+    if (!texture) return;
+    texture->refcount--;
+    texture->last_use = get_time();
+    if (texture->failed && !texture->refcount) remove_texture(texture);
+    else evict_textures(texture->share_group);
+}
+
+//Returns a cached texture, queueing it for decoding and upload on a miss. The
+//texture must not be sampled until it is ready.
+static wip24_texture* acquire_texture(int share_group, const char* src, const char* filter,
+                                      const char* wrap, const char* vflip, const char* srgb,
+                                      unsigned int max_size) {
+    char key[4096];
+    snprintf(key, sizeof(key), "%s|%s|%s|%s|%s|%u", src, filter, wrap, vflip, srgb, max_size);
+    
+    for (wip24_texture* cur = textures; cur; cur = cur->next) {
+        if (cur->share_group==share_group && !strcmp(cur->key, key)) {
+            cur->refcount++;
+            cur->last_use = get_time();
+            return cur;
+        }
+    }
+    
+    wip24_texture* texture = calloc(1, sizeof(wip24_texture));
+    texture->key = strdup(key);
+    texture->share_group = share_group;
+    texture->refcount = 1;
+    texture->last_use = get_time();
+    texture->next = textures;
+    textures = texture;
+    
+    glGenTextures(1, &texture->texture);
+    glBindTexture(GL_TEXTURE_2D, texture->texture);
+    set_texture_params(filter, wrap);
+    queue_upload(texture, src, filter, vflip, srgb, max_size);
+    return texture;
+}
+
+static void load_texture(wip24_state* state, wip24_channel* channel, const char* src,
+                         const char* filter, const char* wrap,
+                         const char* vflip, const char* srgb) {
+    release_texture(channel->texture);
+    
+    //Textures larger than the render target would only ever be minified. Small
+    //ones are left alone since shaders often rely on the exact size of noise
+    //textures. The render target is the size the shader is expected to settle
+    //at rather than the size it starts at.
+    unsigned int max_size = texture_max_size;
+    if (texture_max_size <= 0) {
+        int size = state->width>state->height ? state->width : state->height;
+        size /= state->expected_undersample>1.0f ? state->expected_undersample : 1.0f;
+        for (max_size = 512; max_size < size; max_size *= 2);
+    }
+    
+    channel->texture = acquire_texture(state->share_group, src, filter, wrap, vflip, srgb,
+                                       max_size);
+    channel->type = channel->texture ? channel_image : channel_none;
+}
+
+static void clear_shader(wip24_state* state) {
+    glDeleteProgram(state->program);
+    state->program = 0;
+    state->time_invariant = false;
+    state->rendered = false;
+    state->loading = false;
+    state->ready_inputs = 0;
+    state->tile_index = 0;
+    state->history_valid = false;
+    for (unsigned int i = 0; i < 4; i++) {
+        release_texture(state->channels[i].texture);
+        state->channels[i].texture = NULL;
+        state->channels[i].type = channel_none;
+    }
+}
+
+//Returns whether a program reads any input that changes from frame to frame.
+//iMouse and the channel times are constant here, and iResolution only changes
+//on reshape, which invalidates the frame anyway.
+static bool uses_time(GLuint program) {
+    static const char* names[] = {"iGlobalTime", "iTimeDelta", "iFrame", "iDate"};
+    GLint count;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+    for (GLint i = 0; i < count; i++) {
+        char name[256];
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(program, i, sizeof(name), NULL, &size, &type, name);
+        for (size_t j = 0; j < sizeof(names)/sizeof(names[0]); j++)
+            if (!strcmp(name, names[j])) return true;
+    }
+    return false;
+}
+
+static void set_shader_source(wip24_state* state, const char* source) {
+    state->time_invariant = false;
+    state->rendered = false;
+    GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
+    
+    const char* sources[2] = {source_header, source};
+    glShaderSource(frag, 2, sources, NULL);
+    uint64_t compile_start = get_time();
+    uint64_t start = trace_begin();
+    glCompileShader(frag);
+    GLint status;
+    glGetShaderiv(frag, GL_COMPILE_STATUS, &status);
+    trace_end("compile", NULL, start);
+    if (!status) {
+        char log[1024];
+        glGetShaderInfoLog(frag, sizeof(log), NULL, log);
+        log_entry("Error: Unable to compile shader: %s\n", log);
+        glDeleteShader(frag);
+        state->load_times[load_compile] = get_time() - compile_start;
+        metric_add(&compile_time_sum, state->load_times[load_compile]);
+        metric_add(&compile_count, 1);
+        return;
+    }
+    
+    state->program = glCreateProgram();
+    glAttachShader(state->program, frag);
+    start = trace_begin();
+    glLinkProgram(state->program);
+    glValidateProgram(state->program);
+    glDeleteShader(frag);
+    glGetProgramiv(state->program, GL_LINK_STATUS, &status);
+    trace_end("link", NULL, start);
+    state->load_times[load_compile] = get_time() - compile_start;
+    metric_add(&compile_time_sum, state->load_times[load_compile]);
+    metric_add(&compile_count, 1);
+    if (!status) {
+        char log[1024];
+        glGetProgramInfoLog(state->program, sizeof(log), NULL, log);
+        log_entry("Error: Unable to link program: %s\n", log);
+        glDeleteProgram(state->program);
+        state->program = 0;
+        return;
+    }
+    
+    state->time_invariant = !uses_time(state->program);
+    if (state->time_invariant) log_entry("Shader does not change over time, drawing it once\n");
+}
+
+static json_value* lookup_obj(json_value* obj, const char* key) {
+    if (!obj) return NULL;
+    if (obj->type != json_object) return NULL;
+    
+    for (unsigned int i = 0; i < obj->u.object.length; i++)
+        if (!strcmp(obj->u.object.values[i].name, key))
+            return obj->u.object.values[i].value;
+    
+    return NULL;
+}
+
+typedef struct {
+    const char* src;
+    const char* filter;
+    const char* wrap;
+    const char* vflip;
+    const char* srgb;
+    unsigned int channel;
+} wip24_input;
+
+typedef struct {
+    json_value* root;
+    const char* code;
+    const char* name;
+    const char* author;
+    wip24_input inputs[4];
+    unsigned int input_count;
+} wip24_shader_desc;
+
+typedef enum {parse_ok, parse_error, parse_unsupported} wip24_parse_result;
+
+//Extracts what is needed to display a shader from its JSON. The strings in
+//desc point into desc->root, which has to be freed with json_value_free() if
+//parsing succeeded.
+static wip24_parse_result parse_shader_json(wip24_shader_desc* desc, const char* json,
+                                            size_t json_len) {
+    memset(desc, 0, sizeof(wip24_shader_desc));
+    wip24_parse_result res = parse_error;
+    
+    char error[json_error_max];
+    memset(error, 0, json_error_max);
+    json_settings settings;
+    memset(&settings, 0, sizeof(settings));
+    uint64_t start = trace_begin();
+    json_value* root = json_parse_ex(&settings, json, json_len, error);
+    trace_end("parse", NULL, start);
+    if (!root) {
+        log_entry("Unable to parse JSON: %s\n", error);
+        goto error;
+    }
     
     json_value* error_val = lookup_obj(root, "Error");
     if (error_val && error_val->type==json_string) {
@@ -357,7 +2511,7 @@ static bool set_shader_from_json(wip24_state* state, const char* json, size_t js
     json_value* inputs = lookup_obj(renderpass, "inputs");
     if (!code || !inputs) goto error;
     if (code->type!=json_string || inputs->type!=json_array) goto error;
-    set_shader_source(state, code->u.string.ptr);
+    desc->code = code->u.string.ptr;
     
     for (unsigned int i = 0; i < inputs->u.array.length; i++) {
         json_value* input = inputs->u.array.values[i];
@@ -375,90 +2529,662 @@ static bool set_shader_from_json(wip24_state* state, const char* json, size_t js
             filter->type!=json_string || wrap->type!=json_string || vflip->type!=json_string ||
             sampler->type!=json_object) goto error;
         if (channel->type != json_integer && channel->type != json_double) goto error;
-        if (strcmp(ctype->u.string.ptr, "texture")) goto unsupported;
+        if (strcmp(ctype->u.string.ptr, "texture")) {
+            res = parse_unsupported;
+            goto error;
+        }
         json_int_t channel_idx = channel->type==json_integer?channel->u.integer:channel->u.dbl;
-        if (channel_idx<0 || channel_idx>3) goto error;
-        load_texture(state->channels+channel_idx, src->u.string.ptr, filter->u.string.ptr,
-                     wrap->u.string.ptr, vflip->u.string.ptr, srgb->u.string.ptr);
+        if (channel_idx<0 || channel_idx>3 || desc->input_count>=4) goto error;
+        
+        wip24_input* dest = desc->inputs + desc->input_count++;
+        dest->src = src->u.string.ptr;
+        dest->filter = filter->u.string.ptr;
+        dest->wrap = wrap->u.string.ptr;
+        dest->vflip = vflip->u.string.ptr;
+        dest->srgb = srgb->u.string.ptr;
+        dest->channel = channel_idx;
     }
     
     json_value* name = lookup_obj(lookup_obj(shader, "info"), "name");
     json_value* author = lookup_obj(lookup_obj(shader, "info"), "username");
     if (!name || !author) goto error;
     if (name->type!=json_string || author->type!=json_string) goto error;
+    desc->name = name->u.string.ptr;
+    desc->author = author->u.string.ptr;
+    
+    desc->root = root;
+    return parse_ok;
+    error:
+        if (root) json_value_free(root);
+        if (res == parse_unsupported) log_entry("Shader uses an unsupported feature.\n");
+        else log_entry("Unable to interpret JSON.\n");
+        return res;
+}
+
+static bool set_shader_from_json(wip24_state* state, const char* json, size_t json_len) {
+    glDeleteProgram(state->program);
+    state->program = 0;
+    
+    wip24_shader_desc desc;
+    if (parse_shader_json(&desc, json, json_len) != parse_ok) {
+        clear_shader(state);
+        return false;
+    }
+    
+    set_shader_source(state, desc.code);
+    
+    for (unsigned int i = 0; i < desc.input_count; i++) {
+        const wip24_input* input = desc.inputs + i;
+        load_texture(state, state->channels+input->channel, input->src, input->filter,
+                     input->wrap, input->vflip, input->srgb);
+    }
+    
     snprintf(state->shader_info, sizeof(state->shader_info), "%s by %s",
-             name->u.string.ptr, author->u.string.ptr);
+             desc.name, desc.author);
+    state->label_dirty = true;
+    
+    json_value_free(desc.root);
+    return true;
+}
+
+static bool is_cached(const char* key) {
+    const void* data;
+    size_t size;
+    return pack_lookup(key, &data, &size) || cache_contains(key, NULL, 0);
+}
+
+//Checks whether a shader and all of its inputs can be loaded without the
+//network.
+static bool is_shader_cached(const char* id) {
+    char key[4096];
+    snprintf(key, sizeof(key), "shaders/%s", id);
+    const void* packed;
+    char* json = NULL;
+    size_t json_len;
+    char cached_file[4096];
+    if (pack_lookup(key, &packed, &json_len)) {
+        json = malloc(json_len);
+        memcpy(json, packed, json_len);
+    } else if (cache_contains(key, cached_file, sizeof(cached_file))) {
+        json = read_file(cached_file, &json_len);
+    }
+    if (!json) return false;
+    
+    wip24_shader_desc desc;
+    bool res = parse_shader_json(&desc, json, json_len) == parse_ok;
+    free(json);
+    for (unsigned int i = 0; i<desc.input_count && res; i++) {
+        const wip24_input* input = desc.inputs + i;
+        get_decoded_key(key, sizeof(key), input->src, get_decoded_flags(input->vflip, input->srgb));
+        if (is_cached(key)) continue;
+        snprintf(key, sizeof(key), "images%s", input->src);
+        res = is_cached(key);
+    }
+    if (desc.root) json_value_free(desc.root);
+    return res;
+}
+
+//How expensive each shader is to render, in milliseconds per megapixel, is
+//measured while it is shown and kept in ~/.wip24/costs.txt so that expensive
+//shaders can be skipped when power is limited.
+#define COST_MAX 4096
+#define COST_MIN_SAMPLES 30
+#define COST_SAVE_INTERVAL 60
+
+typedef struct {
+    char id[8];
+    float cost;
+} wip24_shader_cost;
+
+static wip24_shader_cost shader_costs[COST_MAX];
+static size_t shader_cost_count = 0;
+static bool shader_costs_loaded = false;
+
+static void get_costs_filename(char* dest, size_t size) {
+    snprintf(dest, size, "%s/.wip24/costs.txt", get_home_dir());
+}
+
+static wip24_shader_cost* find_shader_cost(const char* id) {
+    if (!shader_costs_loaded) {
+        shader_costs_loaded = true;
+        char filename[4096];
+        get_costs_filename(filename, sizeof(filename));
+        FILE* file = fopen(filename, "r");
+        wip24_shader_cost cost;
+        while (file && shader_cost_count<COST_MAX && fscanf(file, "%7s %f", cost.id, &cost.cost)==2)
+            shader_costs[shader_cost_count++] = cost;
+        if (file) fclose(file);
+    }
+    for (size_t i = 0; i < shader_cost_count; i++)
+        if (!strcmp(shader_costs[i].id, id)) return shader_costs + i;
+    return NULL;
+}
+
+//Returns a negative cost for shaders that have not been measured yet.
+static float get_shader_cost(const char* id) {
+    wip24_shader_cost* cost = find_shader_cost(id);
+    return cost ? cost->cost : -1.0f;
+}
+
+//Milliseconds per megapixel are also nanoseconds per pixel, which is what the
+//tile size is chosen from, so a smoothed copy is kept in pixel_cost.
+static void add_cost_sample(wip24_state* state, uint64_t time, double pixels) {
+    if (pixels < 1.0) return;
+    float cost = time/1000000.0 / (pixels/1000000.0);
+    state->cost_sum += cost;
+    state->cost_samples++;
+    state->pixel_cost = state->pixel_cost>0.0f ? state->pixel_cost*0.75f+cost*0.25f : cost;
+}
+
+//Blends the cost measured while the current shader was shown into its stored
+//cost once there are enough samples for it to mean anything.
+static void save_shader_cost(wip24_state* state) {
+    state->cost_saved = get_time();
+    unsigned int samples = state->cost_samples;
+    state->cost_samples = 0;
+    if (!state->shader_id[0] || samples<COST_MIN_SAMPLES) {
+        state->cost_sum = 0.0;
+        return;
+    }
+    float measured = state->cost_sum / samples;
+    state->cost_sum = 0.0;
+    
+    wip24_shader_cost* cost = find_shader_cost(state->shader_id);
+    if (!cost && shader_cost_count<COST_MAX) {
+        cost = shader_costs + shader_cost_count++;
+        strcpy(cost->id, state->shader_id);
+        cost->cost = measured;
+    } else if (cost) {
+        cost->cost = (cost->cost+measured) / 2.0f;
+    }
+    
+    char filename[4096];
+    get_costs_filename(filename, sizeof(filename));
+    char temp_file[4096+8];
+    FILE* file = create_temp_file(filename, temp_file, sizeof(temp_file));
+    if (!file) return;
+    for (size_t i = 0; i < shader_cost_count; i++)
+        fprintf(file, "%s %f\n", shader_costs[i].id, shader_costs[i].cost);
+    commit_temp_file(file, temp_file, filename, !ferror(file));
+}
+
+//Slows down and limits rendering while running on battery or while the machine
+//is hot. The power supplies and thermal zones are only read every
+//GOVERNOR_INTERVAL seconds.
+#define GOVERNOR_INTERVAL 10
+
+static struct {
+    bool limited;
+    time_t checked;
+} power_state = {false, 0};
+
+static bool read_sysfs(const char* dir, const char* name, const char* attribute,
+                       char* dest, size_t size) {
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s/%s/%s", dir, name, attribute);
+    FILE* file = fopen(filename, "r");
+    if (!file) return false;
+    bool res = fgets(dest, size, file);
+    fclose(file);
+    dest[strcspn(dest, "\n")] = 0;
+    return res;
+}
+
+static bool is_discharging() {
+    const char* dir_name = "/sys/class/power_supply";
+    DIR* dir = opendir(dir_name);
+    if (!dir) return false;
+    bool res = false;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        char type[64], status[64];
+        if (entry->d_name[0] != '.' &&
+            read_sysfs(dir_name, entry->d_name, "type", type, sizeof(type)) &&
+            !strcmp(type, "Battery") &&
+            read_sysfs(dir_name, entry->d_name, "status", status, sizeof(status)) &&
+            !strcmp(status, "Discharging")) res = true;
+    }
+    closedir(dir);
+    return res;
+}
+
+//Returns the temperature of the hottest thermal zone in degrees Celsius.
+static float get_temperature() {
+    const char* dir_name = "/sys/class/thermal";
+    DIR* dir = opendir(dir_name);
+    if (!dir) return 0.0f;
+    float res = 0.0f;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        char temp[64];
+        if (!strncmp(entry->d_name, "thermal_zone", 12) &&
+            read_sysfs(dir_name, entry->d_name, "temp", temp, sizeof(temp))) {
+            float value = atof(temp) / 1000.0f;
+            res = value>res ? value : res;
+        }
+    }
+    closedir(dir);
+    return res;
+}
+
+static bool is_power_limited() {
+    if (!governor) return false;
+    if (difftime(time(NULL), power_state.checked) < GOVERNOR_INTERVAL) return power_state.limited;
+    power_state.checked = time(NULL);
+    
+    bool discharging = is_discharging();
+    float temperature = get_temperature();
+    bool limited = discharging || temperature>=thermal_limit;
+    if (limited != power_state.limited) {
+        log_entry("%s rendering (%s, %.0f C)\n", limited?"Limiting":"No longer limiting",
+                  discharging?"on battery":"on mains power", temperature);
+    }
+    power_state.limited = limited;
+    return limited;
+}
+
+static unsigned long get_frame_delay() {
+    if (!is_power_limited()) return frame_delay;
+    return battery_delay>0 && (unsigned long)battery_delay>frame_delay ? battery_delay : frame_delay;
+}
+
+static float get_undersample_max() {
+    return is_power_limited() ? battery_undersample_max : undersample_max;
+}
+
+//Picks a random shader from shaders.txt. While offline or backing off from a
+//server only shaders that are entirely cached are considered. Which shaders are
+//cached is remembered for a while since checking means parsing their JSON.
+static const char* pick_shader_id() {
+    static char ids[4096][8];
+    static struct {
+        char id[8];
+        bool cached;
+        time_t checked;
+    } known[4096];
+    static size_t known_count = 0;
+    
+    size_t id_count = read_shader_ids(ids, 4096);
+    if (is_offline() || is_backing_off(NULL)) {
+        size_t available = 0;
+        for (size_t i = 0; i < id_count; i++) {
+            size_t j = 0;
+            while (j<known_count && strcmp(known[j].id, ids[i])) j++;
+            if (j == known_count) {
+                if (known_count == 4096) continue;
+                strcpy(known[known_count++].id, ids[i]);
+                known[j].checked = 0;
+            }
+            if (difftime(time(NULL), known[j].checked) > 600) {
+                known[j].cached = is_shader_cached(ids[i]);
+                known[j].checked = time(NULL);
+            }
+            if (known[j].cached) memmove(ids[available++], ids[i], 8);
+        }
+        id_count = available;
+    }
+    
+    //Shaders known to be expensive are avoided while power is limited, unless
+    //that would leave nothing to show.
+    if (is_power_limited() && battery_cost_max>0.0f) {
+        size_t affordable = 0;
+        for (size_t i = 0; i < id_count; i++)
+            if (get_shader_cost(ids[i]) <= battery_cost_max) memmove(ids[affordable++], ids[i], 8);
+        if (affordable) id_count = affordable;
+    }
+    if (!id_count) return NULL;
     
-    json_value_free(root);
-    return true;
-    error:
-        if (root) json_value_free(root);
-        clear_shader(state);
-        log_entry("Unable to interpret JSON.\n");
-        return false;
-    unsupported:
-        if (root) json_value_free(root);
-        clear_shader(state);
-        log_entry("Shader uses an unsupported feature.\n");
-        return false;
+    return ids[ya_random()%id_count];
+}
+
+//Cached shaders are downloaded again in the background once they are two days
+//old so that their names and statistics stay current. The cached copy is only
+//replaced by one that was downloaded and parsed, so that shaders remain
+//available while offline.
+#define SHADER_REFRESH_AGE 172800
+
+static void* refresh_shader(void* userdata) {
+    char* id = userdata;
+    char key[64];
+    snprintf(key, sizeof(key), "shaders/%s", id);
+    char url[2048];
+    get_shader_url(url, sizeof(url), id);
+    
+    wip24_fetch fetch = {get_time()+(uint64_t)(fetch_timeout*1000000000.0), NULL};
+    char* json = NULL;
+    size_t json_len;
+    read_data(url, (void**)&json, &json_len, &fetch);
+    if (json) {
+        wip24_shader_desc desc;
+        if (parse_shader_json(&desc, json, json_len) == parse_ok) {
+            cache_store(key, json, json_len);
+            log_entry("Refreshed cached shader %s\n", id);
+        }
+        if (desc.root) json_value_free(desc.root);
+        free(json);
+    }
+    free(id);
+    return NULL;
+}
+
+static void start_shader_refresh(const char* id) {
+    if (is_offline() || is_backing_off(NULL)) return;
+    pthread_t thread;
+    char* arg = strdup(id);
+    if (pthread_create(&thread, NULL, &refresh_shader, arg)) {
+        free(arg);
+        return;
+    }
+    pthread_detach(thread);
 }
 
 static bool set_shader_from_id(wip24_state* state, const char* id) {
     log_entry("Setting shader to %s\n", id);
     
+    char key[64];
+    snprintf(key, sizeof(key), "shaders/%s", id);
+    const void* packed;
+    size_t packed_size;
+    if (pack_lookup(key, &packed, &packed_size))
+        return set_shader_from_json(state, packed, packed_size);
+    
     char cached_file[4096];
-    snprintf(cached_file, sizeof(cached_file), "%s/.wip24/cache/shaders/%s.json", get_home_dir(), id);
-    FILE* cached = fopen(cached_file, "r");
-    if (!cached) {
+    time_t created;
+    char* json = NULL;
+    size_t json_len;
+    if (cache_lookup(key, cached_file, sizeof(cached_file), &created))
+        json = read_file(cached_file, &json_len);
+    
+    if (!json) {
         char url[2048];
-        snprintf(url, sizeof(url), "www.shadertoy.com/api/v1/shaders/%s?key=%s", id, API_KEY);
+        get_shader_url(url, sizeof(url), id);
         
-        char* json;
-        size_t json_len;
-        read_data(url, (void**)&json, &json_len);
+        //Nothing is drawn while the shader is downloaded, so the render thread
+        //only waits for SHADER_FETCH_FRAMES frames. A download that takes longer
+        //backs off from the host, after which cached shaders are picked.
+        uint64_t timeout = SHADER_FETCH_FRAMES * (uint64_t)frame_delay * 1000;
+        if (!timeout || timeout>fetch_timeout*1000000000.0) timeout = fetch_timeout*1000000000.0;
+        wip24_fetch fetch = {get_time()+timeout, NULL};
+        read_data(url, (void**)&json, &json_len, &fetch);
         if (!json) return false;
-        if (!set_shader_from_json(state, json, json_len)) return false;
-        
-        if (state->program) {
-            cached = fopen(cached_file, "w");
-            fwrite(json, json_len, 1, cached);
-            fclose(cached);
-        }
-        
+        bool res = set_shader_from_json(state, json, json_len);
+        if (res && state->program) cache_store(key, json, json_len);
         free(json);
+        return res;
     } else {
-        fseek(cached, 0, SEEK_END);
-        size_t size = ftell(cached);
-        fseek(cached, 0, SEEK_SET);
-        
-        char *json = (char *)malloc(size);
-        memset(json, 0, size);
-        fread(json, 1, size, cached);
-        
-        if (!set_shader_from_json(state, json, size)) return false;
+        bool res = set_shader_from_json(state, json, json_len);
         free(json);
         
-        fclose(cached);
-        
-        struct stat buf;
-        stat(cached_file, &buf);
+        if (difftime(time(NULL), created) > SHADER_REFRESH_AGE) start_shader_refresh(id);
+        return res;
+    }
+}
+
+typedef struct {
+    char id[8];
+    char* code;
+    const char* error;
+    bool network_failed;
+} wip24_prefetch_result;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    wip24_prefetch_result* results;
+    size_t count;
+    size_t next;
+} wip24_prefetch;
+
+//Makes sure that a shader and all of its inputs are cached, returning NULL on
+//success or the reason it can not be displayed.
+static const char* prefetch_shader(const char* id, char** code, const wip24_fetch* fetch) {
+    char key[64];
+    snprintf(key, sizeof(key), "shaders/%s", id);
+    const void* packed;
+    char cached_file[4096];
+    char* json = NULL;
+    size_t json_len;
+    bool store = false;
+    if (pack_lookup(key, &packed, &json_len)) {
+        json = malloc(json_len);
+        memcpy(json, packed, json_len);
+    } else if (cache_lookup(key, cached_file, sizeof(cached_file), NULL)) {
+        json = read_file(cached_file, &json_len);
+    }
+    if (!json) {
+        char url[2048];
+        get_shader_url(url, sizeof(url), id);
+        read_data(url, (void**)&json, &json_len, fetch);
+        if (!json) return "Unable to download";
+        store = true;
+    }
+    
+    wip24_shader_desc desc;
+    wip24_parse_result res = parse_shader_json(&desc, json, json_len);
+    if (res != parse_ok) {
+        free(json);
+        return res==parse_unsupported ? "Uses an unsupported feature" : "Unable to interpret JSON";
+    }
+    if (store) cache_store(key, json, json_len);
+    free(json);
+    
+    const char* error = NULL;
+    for (unsigned int i = 0; i<desc.input_count && !error; i++) {
+        wip24_image image;
+        if (load_image(&image, desc.inputs[i].src, desc.inputs[i].vflip, desc.inputs[i].srgb,
+                       fetch))
+            free_image(&image);
+        else
+            error = "Unable to load a texture";
+    }
+    
+    if (!error) *code = strdup(desc.code);
+    json_value_free(desc.root);
+    return error;
+}
+
+static void* prefetch_worker(void* userdata) {
+    wip24_prefetch* prefetch = userdata;
+    set_trace_thread_name("prefetch");
+    while (true) {
+        pthread_mutex_lock(&prefetch->mutex);
+        size_t index = prefetch->next++;
+        pthread_mutex_unlock(&prefetch->mutex);
+        if (index >= prefetch->count) return NULL;
         
-        if (difftime(time(NULL), buf.st_mtime) > 172800) { //Two days
-            remove(cached_file);
-            log_entry("Removing cached shader %s\n", id);
+        //A shader that failed because of the network is tried again once its
+        //host may be contacted, since one failed transfer backs off the host for
+        //every job.
+        wip24_prefetch_result* result = prefetch->results + index;
+        wip24_fetch fetch = {get_time()+PREFETCH_TIMEOUT*(uint64_t)1000000000, NULL,
+                             &result->network_failed, true};
+        for (int attempt = 0; attempt < PREFETCH_ATTEMPTS; attempt++) {
+            result->network_failed = false;
+            result->error = prefetch_shader(result->id, &result->code, &fetch);
+            if (!result->error || !result->network_failed || offline) break;
         }
+        log_entry("Prefetched %s (%zu/%zu)%s%s%s\n", result->id, index+1, prefetch->count,
+                  result->error?": ":"", result->error?result->error:"",
+                  result->network_failed?" (network)":"");
     }
-    return true;
+}
+
+//Fills the cache with every shader in shaders.txt using a bounded number of
+//concurrent downloads, optionally test compiling them, and writes the ones that
+//can not be displayed to ~/.wip24/prefetch.txt in a form that can be pasted
+//into shaders.txt. Shaders that could not be downloaded are only logged since
+//they may work once the network does.
+static bool run_prefetch(wip24_state* state) {
+    static char ids[4096][8];
+    wip24_prefetch prefetch;
+    pthread_mutex_init(&prefetch.mutex, NULL);
+    prefetch.count = read_shader_ids(ids, 4096);
+    prefetch.next = 0;
+    prefetch.results = calloc(prefetch.count+1, sizeof(wip24_prefetch_result));
+    for (size_t i = 0; i < prefetch.count; i++) strcpy(prefetch.results[i].id, ids[i]);
+    
+    int jobs = prefetch_jobs<1 ? 1 : prefetch_jobs;
+    pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+    int thread_count = 0;
+    for (; thread_count < jobs; thread_count++)
+        if (pthread_create(threads+thread_count, NULL, &prefetch_worker, &prefetch)) break;
+    if (!thread_count) prefetch_worker(&prefetch);
+    for (int i = 0; i < thread_count; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    
+    char report_file[4096];
+    snprintf(report_file, sizeof(report_file), "%s/.wip24/prefetch.txt", get_home_dir());
+    char temp_file[4096+8];
+    FILE* report = create_temp_file(report_file, temp_file, sizeof(temp_file));
+    bool report_ok = report != NULL;
+    
+    size_t failed = 0;
+    size_t unavailable = 0;
+    for (size_t i = 0; i < prefetch.count; i++) {
+        wip24_prefetch_result* result = prefetch.results + i;
+        if (!result->error && prefetch_compile) {
+            set_shader_source(state, result->code);
+            if (!state->program) result->error = "Unable to compile";
+            glDeleteProgram(state->program);
+            state->program = 0;
+        }
+        if (result->error && result->network_failed) {
+            log_entry("Unable to download %s, it may work once the network does\n", result->id);
+            unavailable++;
+        } else if (result->error) {
+            if (report) report_ok = fprintf(report, "#%s %s\n", result->id, result->error)>0 &&
+                                    report_ok;
+            failed++;
+        }
+        free(result->code);
+    }
+    if (report) report_ok = commit_temp_file(report, temp_file, report_file, report_ok);
+    log_entry("Prefetched %zu of %zu shaders, %zu can not be displayed and %zu could not be "
+              "downloaded\n", prefetch.count-failed-unavailable, prefetch.count, failed, unavailable);
+    if (report_ok) log_entry("Wrote the shaders that failed to %s\n", report_file);
+    else log_entry("Unable to write %s\n", report_file);
+    
+    free(prefetch.results);
+    pthread_mutex_destroy(&prefetch.mutex);
+    flush_cache_index(false);
+    write_trace();
+    return !failed && !unavailable;
+}
+
+//Makes label the render target, (re)creating it at the given size, so that it
+//can be drawn to with the window sized coordinates of print_texture_label().
+static void begin_cached_label(wip24_cached_label* label, int width, int height) {
+    if (!label->texture || label->width!=width || label->height!=height) {
+        glDeleteTextures(1, &label->texture);
+        glGenTextures(1, &label->texture);
+        glBindTexture(GL_TEXTURE_2D, label->texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        if (!label->framebuffer) glGenFramebuffers(1, &label->framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, label->framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, label->texture, 0);
+        label->width = width;
+        label->height = height;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, label->framebuffer);
+    glViewport(0, 0, width, height);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+}
+
+static void end_cached_label(ModeInfo* mi) {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, MI_WIDTH(mi), MI_HEIGHT(mi));
+}
+
+//Draws a label with its bottom left corner at x, y in window coordinates.
+static void draw_cached_label(ModeInfo* mi, const wip24_cached_label* label, int x, int y) {
+    if (!label->texture) return;
+    float x0 = x*2.0f/MI_WIDTH(mi) - 1.0f;
+    float y0 = y*2.0f/MI_HEIGHT(mi) - 1.0f;
+    float x1 = x0 + label->width*2.0f/MI_WIDTH(mi);
+    float y1 = y0 + label->height*2.0f/MI_HEIGHT(mi);
+    
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glBindTexture(GL_TEXTURE_2D, label->texture);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f);
+    glVertex2f(x0, y0);
+    glTexCoord2f(1.0f, 0.0f);
+    glVertex2f(x1, y0);
+    glTexCoord2f(1.0f, 1.0f);
+    glVertex2f(x1, y1);
+    glTexCoord2f(0.0f, 1.0f);
+    glVertex2f(x0, y1);
+    glEnd();
+    glDisable(GL_BLEND);
+}
+
+static void free_cached_label(wip24_cached_label* label) {
+    glDeleteTextures(1, &label->texture);
+    glDeleteFramebuffers(1, &label->framebuffer);
+    memset(label, 0, sizeof(wip24_cached_label));
 }
 
 ENTRYPOINT void reshape_wip24(ModeInfo *mi, int width, int height) {
     wip24_state* state = states + MI_SCREEN(mi);
     glXMakeCurrent(MI_DISPLAY(mi), MI_WINDOW(mi), *(state->glx_context));
     glViewport(0, 0, width, height);
+    if (width!=state->width || height!=state->height) state->label_dirty = true;
+    state->width = width;
+    state->height = height;
     
+    int fb_width = width / state->undersample;
+    int fb_height = height / state->undersample;
+    fb_width = fb_width<1 ? 1 : fb_width;
+    fb_height = fb_height<1 ? 1 : fb_height;
+    if (state->fb_texture && fb_width==state->fb_width && fb_height==state->fb_height) return;
+    state->rendered = false;
+    state->tile_index = 0;
+    
+    //Immutable textures cannot be resized so a new one is made for every size.
+    GLuint old_texture = state->fb_texture;
+    glGenTextures(1, &state->fb_texture);
     glBindTexture(GL_TEXTURE_2D, state->fb_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width/state->undersample,
-                 height/state->undersample, 0, GL_RGB, GL_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    if (texture_storage_supported) {
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB8, fb_width, fb_height);
+    } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, fb_width, fb_height, 0,
+                     GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    }
+    
+    //A tiled pass fills the new texture over several frames, so it starts out
+    //with the previous frame scaled to the new size rather than undefined.
+    if (old_texture) {
+        GLuint framebuffer;
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, state->fb_texture, 0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, state->framebuffer);
+        glBlitFramebuffer(0, 0, state->fb_width, state->fb_height, 0, 0, fb_width, fb_height,
+                          GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteTextures(1, &old_texture);
+    }
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, state->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, state->fb_texture, 0);
+    if (!old_texture) {
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    state->fb_width = fb_width;
+    state->fb_height = fb_height;
 }
 
 ENTRYPOINT void refresh_wip24(ModeInfo *mi) {}
@@ -467,31 +3193,396 @@ ENTRYPOINT void release_wip24(ModeInfo *mi) {
     wip24_state* state = states + MI_SCREEN(mi);
     glXMakeCurrent(MI_DISPLAY(mi), MI_WINDOW(mi), *(state->glx_context));
     
-    for (unsigned int i = 0; i < 4; i++)
-        glDeleteTextures(1, &state->channels[i].texture);
+    save_shader_cost(state);
+    clear_shader(state);
     glDeleteFramebuffers(1, &state->framebuffer);
     glDeleteTextures(1, &state->fb_texture);
-    glDeleteProgram(state->program);
+    glDeleteProgram(state->resolve_program);
+    glDeleteFramebuffers(1, &state->history_framebuffer);
+    glDeleteTextures(2, state->history);
+    free_cached_label(&state->overlay);
+    free_cached_label(&state->label);
+    if (timer_query_supported) glDeleteQueries(TIMER_QUERY_COUNT, state->timer_queries);
+    for (unsigned int i = 0; i < FRAME_FENCE_MAX; i++) glDeleteSync(state->frame_fences[i]);
     free_texture_font(state->font);
+    
+    bool group_alive = false;
+    for (int i = 0; i < state_count; i++)
+        if (states+i!=state && states[i].glx_context && states[i].share_group==state->share_group)
+            group_alive = true;
+    if (!group_alive) {
+        for (wip24_texture* cur = textures; cur;) {
+            wip24_texture* texture = cur;
+            cur = cur->next;
+            if (texture->share_group == state->share_group) remove_texture(texture);
+        }
+        release_upload_buffer(state->share_group);
+    }
+    
     glXDestroyContext(MI_DISPLAY(mi), *state->glx_context);
     free(state->glx_context);
+    state->glx_context = NULL;
 }
 
 static void cleanup() {
+    flush_cache_index(false);
+    write_trace();
+    release_curl_share();
     curl_global_cleanup();
     free(states);
 }
 
 ENTRYPOINT Bool wip24_handle_event(ModeInfo *mi, XEvent *event) {
+    wip24_state* state = states + MI_SCREEN(mi);
+    if (event->type == VisibilityNotify)
+        state->obscured = event->xvisibility.state == VisibilityFullyObscured;
+    else if (event->type == UnmapNotify)
+        state->unmapped = true;
+    else if (event->type == MapNotify)
+        state->unmapped = false;
     return False; /*The event was not handled*/
 }
 
+//Asks the server whether the monitor has been put to sleep at most once per
+//DISPLAY_CHECK_INTERVAL since it is a round trip.
+static bool is_display_off(ModeInfo* mi, wip24_state* state) {
+    static int supported = -1;
+    if (supported < 0) {
+        int event_base, error_base;
+        supported = DPMSQueryExtension(MI_DISPLAY(mi), &event_base, &error_base);
+    }
+    if (!supported) return false;
+    
+    uint64_t now = get_time();
+    if ((now-state->display_checked)/1000000000.0 >= DISPLAY_CHECK_INTERVAL) {
+        CARD16 level;
+        BOOL enabled;
+        state->display_off = DPMSInfo(MI_DISPLAY(mi), &level, &enabled) && enabled &&
+                             level!=DPMSModeOn;
+        state->display_checked = now;
+    }
+    return state->display_off;
+}
+
+//Nothing is rendered while the window can not be seen. The shader's clock is
+//stopped meanwhile so that it continues where it was and is shown for as long
+//as it would have been.
+static bool is_hidden(ModeInfo* mi, wip24_state* state) {
+    bool hidden = state->unmapped || state->obscured || is_display_off(mi, state);
+    if (hidden && !state->hidden_since) {
+        state->hidden_since = get_time();
+        log_entry("Suspending rendering on screen %d\n", MI_SCREEN(mi));
+    } else if (!hidden && state->hidden_since) {
+        state->start_time += get_time() - state->hidden_since;
+        state->hidden_since = 0;
+        state->deadline = 0;
+        mi->pause = frame_delay;
+        log_entry("Resuming rendering on screen %d\n", MI_SCREEN(mi));
+    }
+    return hidden;
+}
+
 static void gl_debug_callback(GLenum source, GLenum type, GLuint id, GLenum severity,
                               GLsizei length, const char *message, const void *user_param) {
     log_entry("OpenGL debug callback: %s\n", message);
 }
 
+//Recreates the context made by init_GL() so that it shares objects with the
+//other screens, allowing them to use the same texture cache entries.
+static void share_context(ModeInfo* mi, wip24_state* state) {
+    static int share_group_count = 0;
+    
+    wip24_state* other = NULL;
+    for (int i = 0; i < state_count && !other; i++)
+        if (states+i!=state && states[i].glx_context) other = states + i;
+    
+    state->share_group = share_group_count++;
+    if (!other) return;
+    
+    XVisualInfo vi_in;
+    vi_in.screen = MI_SCREEN(mi);
+    vi_in.visualid = XVisualIDFromVisual(MI_VISUAL(mi));
+    int count;
+    XVisualInfo* vi_out = XGetVisualInfo(MI_DISPLAY(mi), VisualScreenMask|VisualIDMask,
+                                         &vi_in, &count);
+    if (!vi_out) return;
+    GLXContext context = glXCreateContext(MI_DISPLAY(mi), vi_out, *other->glx_context, True);
+    XFree(vi_out);
+    if (!context) {
+        log_entry("Unable to share a context with screen %d\n", (int)(other-states));
+        return;
+    }
+    
+    glXMakeCurrent(MI_DISPLAY(mi), None, NULL);
+    glXDestroyContext(MI_DISPLAY(mi), *state->glx_context);
+    *state->glx_context = context;
+    state->share_group = other->share_group;
+}
+
+typedef void (*swap_interval_ext_proc)(Display*, GLXDrawable, int);
+typedef Bool (*get_sync_values_oml_proc)(Display*, GLXDrawable, int64_t*, int64_t*, int64_t*);
+typedef Bool (*get_msc_rate_oml_proc)(Display*, GLXDrawable, int32_t*, int32_t*);
+typedef int64_t (*swap_buffers_msc_oml_proc)(Display*, GLXDrawable, int64_t, int64_t, int64_t);
+
+static get_sync_values_oml_proc get_sync_values_oml = NULL;
+static swap_buffers_msc_oml_proc swap_buffers_msc_oml = NULL;
+
+static bool has_glx_extension(ModeInfo* mi, const char* name) {
+    return has_extension(glXQueryExtensionsString(MI_DISPLAY(mi), MI_SCREEN(mi)), name);
+}
+
+//Presents every frame after as many vertical blanks as fit in the frame delay,
+//which the governor may change.
+static void update_swap_interval(wip24_state* state) {
+    unsigned long delay = get_frame_delay();
+    if (delay == state->swap_delay) return;
+    state->swap_delay = delay;
+    state->swap_interval = delay/state->msc_period + 0.5;
+    state->swap_interval = state->swap_interval<1 ? 1 : state->swap_interval;
+    log_entry("Presenting every %d vertical blanks\n", state->swap_interval);
+}
+
+//With -vsync frames are presented on vertical blanks. GLX_OML_sync_control
+//lets every frame be queued for the blank its deadline falls on, otherwise
+//GLX_EXT_swap_control makes swaps wait for the next one.
+static void init_swap_control(ModeInfo* mi, wip24_state* state) {
+    state->oml_sync = false;
+    state->deadline = 0;
+    state->missed_deadlines = state->deadline_frames = 0;
+    if (!vsync) return;
+    
+    if (has_glx_extension(mi, "GLX_OML_sync_control")) {
+        get_msc_rate_oml_proc get_msc_rate = (get_msc_rate_oml_proc)
+            glXGetProcAddressARB((const GLubyte*)"glXGetMscRateOML");
+        get_sync_values_oml = (get_sync_values_oml_proc)
+            glXGetProcAddressARB((const GLubyte*)"glXGetSyncValuesOML");
+        swap_buffers_msc_oml = (swap_buffers_msc_oml_proc)
+            glXGetProcAddressARB((const GLubyte*)"glXSwapBuffersMscOML");
+        int32_t numerator, denominator;
+        if (get_msc_rate && get_sync_values_oml && swap_buffers_msc_oml &&
+            get_msc_rate(MI_DISPLAY(mi), MI_WINDOW(mi), &numerator, &denominator) &&
+            numerator>0 && denominator>0) {
+            state->msc_period = 1000000.0 * denominator / numerator;
+            state->swap_delay = 0;
+            state->target_msc = 0;
+            state->oml_sync = true;
+            log_entry("Vertical blanks are at %.2f Hz\n", (double)numerator/denominator);
+            update_swap_interval(state);
+            return;
+        }
+    }
+    
+    if (has_glx_extension(mi, "GLX_EXT_swap_control")) {
+        swap_interval_ext_proc swap_interval = (swap_interval_ext_proc)
+            glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalEXT");
+        if (swap_interval) swap_interval(MI_DISPLAY(mi), MI_WINDOW(mi), 1);
+        return;
+    }
+    log_entry("Unable to synchronize with vertical blanks\n");
+}
+
+static void swap_buffers(ModeInfo* mi, wip24_state* state) {
+    if (!state->oml_sync) {
+        glXSwapBuffers(MI_DISPLAY(mi), MI_WINDOW(mi));
+        return;
+    }
+    
+    int64_t ust, msc, sbc;
+    if (!get_sync_values_oml(MI_DISPLAY(mi), MI_WINDOW(mi), &ust, &msc, &sbc)) {
+        glXSwapBuffers(MI_DISPLAY(mi), MI_WINDOW(mi));
+        return;
+    }
+    update_swap_interval(state);
+    int64_t target = state->target_msc + state->swap_interval;
+    if (!state->target_msc || target<=msc) target = msc + 1;
+    swap_buffers_msc_oml(MI_DISPLAY(mi), MI_WINDOW(mi), target, 0, 0);
+    state->target_msc = target;
+}
+
+//Frames are started at absolute deadlines one delay apart, so that time spent
+//outside of draw_wip24() does not add up. A frame that ends after the next one
+//should have started is counted as missed and the schedule restarts from now
+//instead of trying to catch up.
+static void schedule_next_frame(ModeInfo* mi, wip24_state* state, uint64_t frame_start) {
+    uint64_t now = get_time();
+    uint64_t delay = get_frame_delay() * (uint64_t)1000;
+    uint64_t next = (state->deadline ? state->deadline : frame_start) + delay;
+    state->deadline_frames++;
+    if (next < now) {
+        state->missed_deadlines++;
+        wip24_screen_metrics* metrics = get_screen_metrics(MI_SCREEN(mi));
+        if (metrics) metric_add(&metrics->missed_deadlines, 1);
+        next = now;
+    }
+    state->deadline = next;
+    mi->pause = (next-now) / 1000;
+}
+
+//With -temporal every frame is drawn with a different sub-pixel offset and the
+//undersampled frames are accumulated into a history at the window's size
+//instead of being stretched. The history is clamped to the colours around each
+//pixel in the new frame so that it can not leave trails behind moving parts.
+static const char* resolve_source = "uniform sampler2D current;\n"
+                                    "uniform sampler2D history;\n"
+                                    "uniform vec2 currentSize;\n"
+                                    "uniform vec2 outputSize;\n"
+                                    "uniform vec2 jitter;\n"
+                                    "uniform float reset;\n"
+                                    "uniform float minWeight;\n"
+                                    "void main() {\n"
+                                    "    vec2 uv = gl_FragCoord.xy / outputSize;\n"
+                                    "    vec2 p = uv*currentSize - jitter - 0.5;\n"
+                                    "    vec2 nearest = floor(p + 0.5);\n"
+                                    "    vec2 d = (p-nearest) * outputSize / currentSize;\n"
+                                    "    float w = exp(-0.5 * dot(d, d));\n"
+                                    "    vec3 lo = vec3(1.0), hi = vec3(0.0), near;\n"
+                                    "    for (int y = -1; y <= 1; y++)\n"
+                                    "        for (int x = -1; x <= 1; x++) {\n"
+                                    "            vec2 t = (nearest+vec2(x, y)+0.5) / currentSize;\n"
+                                    "            vec3 c = texture2D(current, t).rgb;\n"
+                                    "            if (x==0 && y==0) near = c;\n"
+                                    "            lo = min(lo, c);\n"
+                                    "            hi = max(hi, c);\n"
+                                    "        }\n"
+                                    "    vec3 filtered = texture2D(current, uv - jitter/currentSize).rgb;\n"
+                                    "    vec3 color = mix(filtered, near, w);\n"
+                                    "    vec3 previous = clamp(texture2D(history, uv).rgb, lo, hi);\n"
+                                    "    float weight = max(mix(minWeight, 0.5, w), reset);\n"
+                                    "    gl_FragColor = vec4(mix(previous, color, weight), 1.0);\n"
+                                    "}\n";
+
+static void init_temporal(wip24_state* state) {
+    state->history[0] = state->history[1] = 0;
+    state->history_width = state->history_height = 0;
+    state->history_valid = false;
+    glGenFramebuffers(1, &state->history_framebuffer);
+    
+    GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(frag, 1, &resolve_source, NULL);
+    glCompileShader(frag);
+    state->resolve_program = glCreateProgram();
+    glAttachShader(state->resolve_program, frag);
+    glLinkProgram(state->resolve_program);
+    glDeleteShader(frag);
+    GLint status;
+    glGetProgramiv(state->resolve_program, GL_LINK_STATUS, &status);
+    if (!status) {
+        char log[1024];
+        glGetProgramInfoLog(state->resolve_program, sizeof(log), NULL, log);
+        log_entry("Error: Unable to link temporal resolve program: %s\n", log);
+        glDeleteProgram(state->resolve_program);
+        state->resolve_program = 0;
+    }
+}
+
+//Shaders that are drawn once are drawn at full resolution and tiled passes are
+//drawn over several frames with a single offset, so neither is accumulated.
+static bool is_temporal(wip24_state* state) {
+    return state->resolve_program && state->undersample>1.0f &&
+           !state->time_invariant && !state->tile_size;
+}
+
+static float halton(unsigned int index, unsigned int base) {
+    float res = 0.0f;
+    for (float f = 1.0f/base; index; f /= base, index /= base) res += f * (index%base);
+    return res;
+}
+
+//Each undersampled pixel covers ceil(undersample)^2 pixels of the history and
+//it takes as many offsets for a sample to land near each of them. Beyond
+//JITTER_MAX offsets, at an undersample factor of 32, they are revisited too
+//rarely for the history to hold on to them.
+static unsigned int get_jitter_count(wip24_state* state) {
+    unsigned int size = ceil(state->undersample);
+    unsigned int count = size * size;
+    return count<4 ? 4 : count>JITTER_MAX ? JITTER_MAX : count;
+}
+
+//Offsets follow the (2, 3) Halton sequence so that they cover the pixel evenly.
+static void next_jitter(wip24_state* state) {
+    if (!is_temporal(state)) {
+        state->jitter[0] = state->jitter[1] = 0.0f;
+        return;
+    }
+    unsigned int index = state->jitter_index++%get_jitter_count(state) + 1;
+    state->jitter[0] = halton(index, 2) - 0.5f;
+    state->jitter[1] = halton(index, 3) - 0.5f;
+}
+
+static GLuint resolve_temporal(ModeInfo* mi, wip24_state* state) {
+    int width = MI_WIDTH(mi), height = MI_HEIGHT(mi);
+    if (width!=state->history_width || height!=state->history_height) {
+        glDeleteTextures(2, state->history);
+        glGenTextures(2, state->history);
+        for (unsigned int i = 0; i < 2; i++) {
+            glBindTexture(GL_TEXTURE_2D, state->history[i]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            if (texture_storage_supported) {
+                glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB8, width, height);
+            } else {
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0,
+                             GL_RGB, GL_UNSIGNED_BYTE, NULL);
+            }
+        }
+        state->history_width = width;
+        state->history_height = height;
+        state->history_valid = false;
+    }
+    
+    GLuint previous = state->history[state->history_index];
+    GLuint next = state->history[state->history_index^1];
+    glBindFramebuffer(GL_FRAMEBUFFER, state->history_framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, next, 0);
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    
+    GLuint program = state->resolve_program;
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "current"), 0);
+    glUniform1i(glGetUniformLocation(program, "history"), 1);
+    glUniform2f(glGetUniformLocation(program, "currentSize"),
+                (int)(width/state->undersample), (int)(height/state->undersample));
+    glUniform2f(glGetUniformLocation(program, "outputSize"), width, height);
+    glUniform2f(glGetUniformLocation(program, "jitter"), state->jitter[0], state->jitter[1]);
+    glUniform1f(glGetUniformLocation(program, "reset"), state->history_valid?0.0f:1.0f);
+    //Pixels that no sample landed near fade towards the filtered frame at a rate
+    //that lets the history last for about one cycle of offsets.
+    float min_weight = 1.0f / get_jitter_count(state);
+    glUniform1f(glGetUniformLocation(program, "minWeight"),
+                min_weight<TEMPORAL_MIN_WEIGHT ? TEMPORAL_MIN_WEIGHT : min_weight);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, previous);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, state->fb_texture);
+    glRectf(-1.0f, -1.0f, 1.0f, 1.0f);
+    glUseProgram(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    
+    state->history_index ^= 1;
+    state->history_valid = true;
+    return next;
+}
+
+//Returns the undersample factor a shader is expected to settle at given its
+//stored cost, or 1 if it has not been measured yet.
+static float get_expected_undersample(wip24_state* state, const char* id) {
+    float cost = get_shader_cost(id);
+    if (cost<=0.0f || !frame_delay) return 1.0f;
+    double frame = (double)cost * state->width * state->height / 1000000.0;
+    float undersample = sqrt(frame / (frame_delay/1000.0));
+    float max = get_undersample_max();
+    return undersample<1.0f ? 1.0f : undersample>max ? max : undersample;
+}
+
 static void init_shader(ModeInfo* mi, wip24_state* state) {
+    save_shader_cost(state);
+    state->gpu_time = 0;
+    if (state->missed_deadlines) {
+        log_entry("Missed %u of %u frame deadlines\n", state->missed_deadlines,
+                  state->deadline_frames);
+    }
+    state->missed_deadlines = state->deadline_frames = 0;
     clear_shader(state);
     
     state->start_time = get_time();
@@ -502,24 +3593,56 @@ static void init_shader(ModeInfo* mi, wip24_state* state) {
     
     reshape_wip24(mi, MI_WIDTH(mi), MI_HEIGHT(mi));
     
+    state->load_start = get_time();
+    memset(state->load_times, 0, sizeof(state->load_times));
     for (size_t i = 0; i < 16; i++) {
+        uint64_t start = trace_begin();
         const char* id = pick_shader_id();
+        trace_end("pick", id, start);
         if (!id) {
             log_entry("Unable to pick a shader\n");
             return;
         }
-        if (set_shader_from_id(state, id)) return; 
+        start = get_time();
+        state->load_times[load_compile] = 0;
+        state->expected_undersample = get_expected_undersample(state, id);
+        bool ok = set_shader_from_id(state, id);
+        metric_add(ok&&state->program?&shaders_loaded:&shaders_failed, 1);
+        if (ok) {
+            state->inputs_start = get_time();
+            state->load_times[load_shader] = state->inputs_start - start -
+                                             state->load_times[load_compile];
+            strcpy(state->shader_id, id);
+            state->pixel_cost = get_shader_cost(id);
+            state->loading = true;
+            return;
+        }
     }
     log_entry("Unable to set a shader\n");
+    write_trace();
 }
 
 ENTRYPOINT void init_wip24(ModeInfo *mi) {
     if (!states) {
         atexit(&cleanup);
         states = calloc(1, MI_NUM_SCREENS(mi)*sizeof(wip24_state));
+        state_count = MI_NUM_SCREENS(mi);
+        frame_delay = mi->pause;
         curl_global_init(CURL_GLOBAL_DEFAULT);
+        init_curl_share();
+        set_trace_thread_name("render");
         log_entry("New process\n");
         ensure_cache_dir();
+        migrate_old_cache();
+        start_cache_flusher();
+        
+        atomic_store(&metrics_screen_count, state_count<METRICS_SCREEN_MAX ? state_count : METRICS_SCREEN_MAX);
+        if (!prefetch) start_metrics_writer();
+        
+        size_t len = endpoint ? strlen(endpoint) : 0;
+        while (len && endpoint[len-1]=='/') endpoint[--len] = 0;
+        
+        load_packs();
     }
     
     log_entry("Begin initialization for screen %d\n", MI_SCREEN(mi));
@@ -527,22 +3650,36 @@ ENTRYPOINT void init_wip24(ModeInfo *mi) {
     wip24_state* state = states + MI_SCREEN(mi);
     
     state->glx_context = init_GL(mi);
+    share_context(mi, state);
     state->program = 0;
     state->font = load_texture_font(MI_DISPLAY(mi), "fpsFont");
     
     glXMakeCurrent(MI_DISPLAY(mi), MI_WINDOW(mi), *(state->glx_context));
-    if (strstr((const char*)glGetString(GL_EXTENSIONS), "GL_ARB_debug_output")) {
+    if (has_gl_extension("GL_ARB_debug_output")) {
         glEnable(GL_DEBUG_OUTPUT);
         glDebugMessageCallbackARB((GLDEBUGPROCARB)gl_debug_callback, NULL);
     }
-    glGenFramebuffers(1, &state->framebuffer);
-    glGenTextures(1, &state->fb_texture);
+    texture_storage_supported = has_gl_extension("GL_ARB_texture_storage");
+    timer_query_supported = has_gl_extension("GL_ARB_timer_query");
+    sync_supported = has_gl_extension("GL_ARB_sync");
+    if (prefetch) exit(run_prefetch(state)?0:1);
     
-    glBindFramebuffer(GL_FRAMEBUFFER, state->framebuffer);
-    glBindTexture(GL_TEXTURE_2D, state->fb_texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                           GL_TEXTURE_2D, state->fb_texture, 0);
+    init_upload_buffer(state->share_group);
+    XWindowAttributes attributes;
+    XGetWindowAttributes(MI_DISPLAY(mi), MI_WINDOW(mi), &attributes);
+    XSelectInput(MI_DISPLAY(mi), MI_WINDOW(mi), attributes.your_event_mask |
+                 VisibilityChangeMask | StructureNotifyMask);
+    state->unmapped = state->obscured = state->display_off = false;
+    state->display_checked = state->hidden_since = 0;
+    init_swap_control(mi, state);
+    
+    glGenFramebuffers(1, &state->framebuffer);
+    state->fb_texture = 0;
+    if (temporal) init_temporal(state);
+    if (timer_query_supported) glGenQueries(TIMER_QUERY_COUNT, state->timer_queries);
+    state->timer_query_first = state->timer_query_count = 0;
+    memset(state->frame_fences, 0, sizeof(state->frame_fences));
+    state->frame_fence_index = 0;
     glEnable(GL_TEXTURE_2D);
     
     init_shader(mi, state);
@@ -555,13 +3692,16 @@ static void update_uniforms(ModeInfo* mi, wip24_state* state) {
     glUniform3f(loc, MI_WIDTH(mi)/state->undersample, MI_HEIGHT(mi)/state->undersample, 1.0f);
     
     loc = glGetUniformLocation(state->program, "iGlobalTime");
-    glUniform1f(loc, (get_time()-state->start_time) / 1000000000.0f);
+    glUniform1f(loc, state->pass_time / 1000000000.0f);
     
     loc = glGetUniformLocation(state->program, "iTimeDelta");
     glUniform1f(loc, state->time_delta);
     
     loc = glGetUniformLocation(state->program, "iFrame");
-    glUniform1i(loc, state->frame_count);
+    glUniform1i(loc, state->pass_frame);
+    
+    loc = glGetUniformLocation(state->program, "iJitter");
+    glUniform2f(loc, state->jitter[0], state->jitter[1]);
     
     loc = glGetUniformLocation(state->program, "iMouse");
     glUniform4f(loc, 0.0f, (MI_HEIGHT(mi)-1)/state->undersample, 0.0f, 0.0f);
@@ -577,13 +3717,13 @@ static void update_uniforms(ModeInfo* mi, wip24_state* state) {
                                           "iChannelTime[2]", "iChannelTime[3]"};
     for (unsigned int i = 0; i < 4; i++) {
         glActiveTexture(GL_TEXTURE0+i);
-        glBindTexture(GL_TEXTURE_2D, state->channels[i].texture);
+        wip24_texture* texture = state->channels[i].texture;
+        if (texture && !texture->ready) texture = NULL;
+        glBindTexture(GL_TEXTURE_2D, texture?texture->texture:0);
         loc = glGetUniformLocation(state->program, channels[i]);
         glUniform1i(loc, i);
-        if (!state->channels[i].texture) continue;
-        GLint w, h;
-        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &w);
-        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &h);
+        if (!texture) continue;
+        GLint w = texture->width, h = texture->height;
         loc = glGetUniformLocation(state->program, channelsRes1[i]);
         glUniform3f(loc, w, h, 1.0);
         loc = glGetUniformLocation(state->program, channelsRes2[i]);
@@ -602,25 +3742,284 @@ static void update_uniforms(ModeInfo* mi, wip24_state* state) {
                 date->tm_sec);
 }
 
+//At most -framesInFlight frames are queued at once. Each frame is fenced after
+//it is presented and the fence from that many frames ago is waited on before
+//the next one is drawn, so that the driver's queue depth does not decide the
+//latency or how long swaps block. Returns the time spent waiting.
+static uint64_t wait_for_frame_slot(wip24_state* state) {
+    if (!sync_supported) return 0;
+    unsigned int count = frames_in_flight<1 ? 1 : frames_in_flight>FRAME_FENCE_MAX ?
+                         FRAME_FENCE_MAX : frames_in_flight;
+    GLsync* fence = state->frame_fences + state->frame_fence_index%count;
+    if (!*fence) return 0;
+    
+    uint64_t start = get_time();
+    glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    glDeleteSync(*fence);
+    *fence = NULL;
+    return get_time() - start;
+}
+
+static void fence_frame(wip24_state* state) {
+    if (!sync_supported) return;
+    unsigned int count = frames_in_flight<1 ? 1 : frames_in_flight>FRAME_FENCE_MAX ?
+                         FRAME_FENCE_MAX : frames_in_flight;
+    GLsync* fence = state->frame_fences + state->frame_fence_index++%count;
+    glDeleteSync(*fence);
+    *fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+//GPU time is measured with a ring of timer queries whose results are collected
+//frames later, once they are available, so that the render loop never waits.
+static bool begin_gpu_timer(wip24_state* state, double pixels) {
+    if (!timer_query_supported || state->timer_query_count==TIMER_QUERY_COUNT) return false;
+    unsigned int index = (state->timer_query_first+state->timer_query_count) % TIMER_QUERY_COUNT;
+    state->timer_query_pixels[index] = pixels;
+    glBeginQuery(GL_TIME_ELAPSED, state->timer_queries[index]);
+    state->timer_query_count++;
+    return true;
+}
+
+static void read_gpu_timers(ModeInfo* mi, wip24_state* state) {
+    while (state->timer_query_count) {
+        GLuint query = state->timer_queries[state->timer_query_first];
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) break;
+        GLuint64 time;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &time);
+        state->gpu_time = time;
+        record_gpu_time(MI_SCREEN(mi), time);
+        if (state->program && !state->loading)
+            add_cost_sample(state, time, state->timer_query_pixels[state->timer_query_first]);
+        state->timer_query_first = (state->timer_query_first+1) % TIMER_QUERY_COUNT;
+        state->timer_query_count--;
+    }
+}
+
+//Returns the side of the square tiles a frame has to be drawn in so that no
+//single draw takes longer than -tileBudget milliseconds, or 0 if the whole
+//frame fits.
+static int get_tile_size(wip24_state* state, int width, int height) {
+    if (tile_budget<=0.0f || state->pixel_cost<=0.0f) return 0;
+    double pixels = tile_budget*1000000.0 / state->pixel_cost;
+    if (pixels >= (double)width*height) return 0;
+    int size = sqrt(pixels);
+    return size<TILE_MIN_SIZE ? TILE_MIN_SIZE : size;
+}
+
+//Very heavy shaders are drawn in scissored tiles so that no submission runs
+//long enough to trip a GPU watchdog or to leave the desktop unresponsive when
+//the screensaver exits. As many tiles are drawn each frame as fit in the frame
+//delay and the image is refined over several frames if it takes longer. Every
+//tile of a pass sees the same time. Returns the number of pixels drawn.
+static double draw_tiles(ModeInfo* mi, wip24_state* state, int width, int height) {
+    if (!state->tile_index) {
+        state->tile_size = get_tile_size(state, width, height);
+        state->pass_time = get_time() - state->start_time;
+        state->pass_frame = state->frame_count;
+        next_jitter(state);
+    }
+    update_uniforms(mi, state);
+    
+    int size = state->tile_size;
+    if (!size) {
+        bool timed = begin_gpu_timer(state, (double)width*height);
+        glRectf(-1.0f, -1.0f, 1.0f, 1.0f);
+        if (timed) glEndQuery(GL_TIME_ELAPSED);
+        state->rendered = true;
+        return (double)width * height;
+    }
+    
+    unsigned int columns = (width+size-1) / size;
+    unsigned int tile_count = columns * ((height+size-1)/size);
+    double budget = frame_delay * 1000.0;
+    double pixels = 0.0;
+    glEnable(GL_SCISSOR_TEST);
+    do {
+        int x = state->tile_index%columns * size;
+        int y = state->tile_index/columns * size;
+        double tile_pixels = (double)(x+size>width ? width-x : size) *
+                             (y+size>height ? height-y : size);
+        glScissor(x, y, size, size);
+        bool timed = begin_gpu_timer(state, tile_pixels);
+        glRectf(-1.0f, -1.0f, 1.0f, 1.0f);
+        if (timed) glEndQuery(GL_TIME_ELAPSED);
+        glFlush();
+        pixels += tile_pixels;
+    } while (++state->tile_index<tile_count &&
+             (pixels+(double)size*size)*state->pixel_cost<budget);
+    glDisable(GL_SCISSOR_TEST);
+    
+    if (state->tile_index == tile_count) {
+        state->tile_index = 0;
+        state->rendered = true;
+    }
+    return pixels;
+}
+
+//Lays the shader's name and author out into a texture when they change, in the
+//corner the frame rate is not in, and then only composites it. With
+//-labelDuration it is only shown for the first seconds of a shader.
+static void draw_shader_label(ModeInfo* mi, wip24_state* state) {
+    static int position = 0;
+    if (!position) position = get_boolean_resource(MI_DISPLAY(mi), "fpsTop", "FPSTop") ? 2 : 1;
+    if (!state->shader_info[0]) return;
+    if (label_duration>0.0f && (get_time()-state->start_time)/1000000000.0>label_duration) return;
+    
+    if (state->label_dirty) {
+        state->label_dirty = false;
+        XCharStruct metrics;
+        int ascent, descent;
+        texture_string_metrics(state->font, state->shader_info, &metrics, &ascent, &descent);
+        int line_height = ascent + descent;
+        int width = metrics.width + line_height*2;
+        int height = metrics.ascent + metrics.descent + line_height*2;
+        width = width>MI_WIDTH(mi) ? MI_WIDTH(mi) : width<1 ? 1 : width;
+        height = height>MI_HEIGHT(mi) ? MI_HEIGHT(mi) : height<1 ? 1 : height;
+        
+        begin_cached_label(&state->label, width, height);
+        print_texture_label(MI_DISPLAY(mi), state->font, width, height, position,
+                            state->shader_info);
+        end_cached_label(mi);
+    }
+    
+    draw_cached_label(mi, &state->label, 0, position==1 ? MI_HEIGHT(mi)-state->label.height : 0);
+}
+
+//Draws recent frame times along the bottom of the overlay, scaled so that the
+//target frame time is at half its height.
+static void draw_sparkline(ModeInfo* mi, wip24_state* state, float height) {
+    float target = frame_delay>0 ? frame_delay/1000.0f : 16.7f;
+    float top = -1.0f + height;
+    
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_BLEND);
+    glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glColor4f(0.0f, 0.0f, 0.0f, 0.6f);
+    glRectf(-1.0f, -1.0f, 1.0f, top);
+    glDisable(GL_BLEND);
+    
+    glColor4f(0.5f, 0.5f, 0.5f, 1.0f);
+    glBegin(GL_LINES);
+    glVertex2f(-1.0f, -1.0f+height/2.0f);
+    glVertex2f(1.0f, -1.0f+height/2.0f);
+    glEnd();
+    
+    glColor4f(0.2f, 1.0f, 0.2f, 1.0f);
+    glBegin(GL_LINE_STRIP);
+    for (unsigned int i = 0; i < OVERLAY_SAMPLES; i++) {
+        float time = state->frame_times[(state->frame_time_index+i)%OVERLAY_SAMPLES];
+        float y = time / target * height / 2.0f;
+        glVertex2f(-1.0f + i*2.0f/(OVERLAY_SAMPLES-1), -1.0f + (y>height?height:y));
+    }
+    glEnd();
+    glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+    glEnable(GL_TEXTURE_2D);
+}
+
+//Shows why a shader is slow: GPU and frame times, the undersample factor the
+//controller is heading towards, the render resolution and how long each stage
+//of loading the shader took. It is only laid out a few times a second.
+static void draw_overlay(ModeInfo* mi, wip24_state* state) {
+    uint64_t now = get_time();
+    if (!state->overlay.texture || (now-state->overlay_time)/1000000000.0>OVERLAY_INTERVAL) {
+        state->overlay_time = now;
+        float target = (state->undersamples[0]+state->undersamples[1]+
+                        state->undersamples[2]+state->undersamples[3]) / 2.0f;
+        target = target>get_undersample_max() ? get_undersample_max() : target;
+        int width = MI_WIDTH(mi)/state->undersample;
+        int height = MI_HEIGHT(mi)/state->undersample;
+        
+        char text[1024];
+        snprintf(text, sizeof(text),
+                 "GPU: %.2f ms\nFrame: %.2f ms, missed %u of %u\nUndersample: %.2f -> %.2f\n"
+                 "Resolution: %dx%d of %dx%d\n"
+                 "Load: shader %.0f ms, compile %.0f ms,\n      inputs %.0f ms, first draw %.1f ms",
+                 timer_query_supported ? state->gpu_time/1000000.0 : 0.0,
+                 state->time_delta/1000000.0, state->missed_deadlines, state->deadline_frames,
+                 state->undersample, target,
+                 width, height, MI_WIDTH(mi), MI_HEIGHT(mi),
+                 state->load_times[load_shader]/1000000.0,
+                 state->load_times[load_compile]/1000000.0,
+                 state->load_times[load_inputs]/1000000.0,
+                 state->load_times[load_first_draw]/1000000.0);
+        
+        int overlay_width = OVERLAY_WIDTH>MI_WIDTH(mi) ? MI_WIDTH(mi) : OVERLAY_WIDTH;
+        int overlay_height = OVERLAY_HEIGHT>MI_HEIGHT(mi) ? MI_HEIGHT(mi) : OVERLAY_HEIGHT;
+        overlay_width = overlay_width<1 ? 1 : overlay_width;
+        overlay_height = overlay_height<1 ? 1 : overlay_height;
+        
+        begin_cached_label(&state->overlay, overlay_width, overlay_height);
+        draw_sparkline(mi, state, 0.5f);
+        print_texture_label(MI_DISPLAY(mi), state->font, overlay_width, overlay_height, 1, text);
+        end_cached_label(mi);
+    }
+    
+    draw_cached_label(mi, &state->overlay, MI_WIDTH(mi)-state->overlay.width,
+                      MI_HEIGHT(mi)-state->overlay.height);
+}
+
 ENTRYPOINT void draw_wip24(ModeInfo *mi) {
     uint64_t frame_start = get_time();
     wip24_state* state = states + MI_SCREEN(mi);
     
+    if (is_hidden(mi, state)) {
+        mi->pause = HIDDEN_DELAY;
+        return;
+    }
+    
     glXMakeCurrent(MI_DISPLAY(mi), MI_WINDOW(mi), *(state->glx_context));
+    uint64_t fence_wait = wait_for_frame_slot(state);
+    process_uploads(state->share_group);
+    read_gpu_timers(mi, state);
+    
+    //The shader starts once all of its inputs have been decoded and uploaded, or
+    //after INPUT_WAIT seconds with placeholders for the ones that are still
+    //loading. Inputs that arrive later are drawn as soon as they are ready.
+    bool first_draw = false;
+    bool drawn = false;
+    double drawn_pixels = 0.0;
+    unsigned int ready_inputs = 0;
+    bool waiting = false;
+    for (unsigned int i = 0; i < 4; i++) {
+        wip24_texture* texture = state->channels[i].texture;
+        if (texture && texture->ready) ready_inputs++;
+        if (texture && !texture->ready && !texture->failed) waiting = true;
+    }
+    if (ready_inputs != state->ready_inputs) state->rendered = false;
+    state->ready_inputs = ready_inputs;
+    if (state->loading) {
+        state->loading = waiting && (get_time()-state->inputs_start)/1000000000.0<INPUT_WAIT;
+        if (waiting && !state->loading)
+            log_entry("Starting shader with placeholders for inputs that are still loading\n");
+        state->start_time = get_time();
+        state->frame_count = 0;
+        first_draw = !state->loading && state->program;
+    }
     
     glBindFramebuffer(GL_FRAMEBUFFER, state->framebuffer);
     glDrawBuffer(GL_COLOR_ATTACHMENT0);
-    glViewport(0, 0, MI_WIDTH(mi)/state->undersample, MI_HEIGHT(mi)/state->undersample);
-    if (state->program) {
+    int fb_width = MI_WIDTH(mi) / state->undersample;
+    int fb_height = MI_HEIGHT(mi) / state->undersample;
+    glViewport(0, 0, fb_width, fb_height);
+    if (state->loading) {
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+    } else if (state->program && !(state->time_invariant && state->rendered)) {
         glUseProgram(state->program);
-        update_uniforms(mi, state);
-        glRectf(-1.0f, -1.0f, 1.0f, 1.0f);
+        drawn_pixels = draw_tiles(mi, state, fb_width, fb_height);
+        drawn = true;
     }
     
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
     glViewport(0, 0, MI_WIDTH(mi), MI_HEIGHT(mi));
     glUseProgram(0);
-    glBindTexture(GL_TEXTURE_2D, state->fb_texture);
+    GLuint texture = state->fb_texture;
+    if (!is_temporal(state)) state->history_valid = false;
+    else if (drawn) texture = resolve_temporal(mi, state);
+    else if (state->history_valid) texture = state->history[state->history_index];
+    glBindTexture(GL_TEXTURE_2D, texture);
     glBegin(GL_QUADS);
     glTexCoord2f(0.0f, 0.0f);
     glVertex2f(-1.0f, -1.0f);
@@ -634,31 +4033,60 @@ ENTRYPOINT void draw_wip24(ModeInfo *mi) {
     
     if (mi->fps_p) do_fps(mi);
     
-    print_texture_label(MI_DISPLAY(mi), state->font, MI_WIDTH(mi), MI_HEIGHT(mi),
-                        get_boolean_resource(MI_DISPLAY(mi), "fpsTop", "FPSTop")?2:1,
-                        state->shader_info);
+    draw_shader_label(mi, state);
+    if (overlay) draw_overlay(mi, state);
     
-    glXSwapBuffers(MI_DISPLAY(mi), MI_WINDOW(mi));
+    swap_buffers(mi, state);
+    fence_frame(state);
     
-    state->time_delta = get_time() - frame_start;
+    if (first_draw) {
+        state->load_times[load_inputs] = frame_start - state->inputs_start;
+        state->load_times[load_first_draw] = get_time() - frame_start;
+        trace_end("first draw", state->shader_id, frame_start);
+        trace_end("load", state->shader_id, state->load_start);
+        write_trace();
+    }
+    
+    state->time_delta = get_time() - frame_start - fence_wait;
     state->frame_count++;
+    record_frame_metrics(MI_SCREEN(mi), state->time_delta, state->undersample);
+    state->frame_times[state->frame_time_index++%OVERLAY_SAMPLES] = state->time_delta/1000000.0f;
+    
+    if (drawn && !timer_query_supported) add_cost_sample(state, state->time_delta, drawn_pixels);
+    //Costs are saved while a shader is shown since most sessions end before it
+    //would be replaced.
+    if (state->cost_samples>=COST_MIN_SAMPLES &&
+        get_time()-state->cost_saved>COST_SAVE_INTERVAL*(uint64_t)1000000000)
+        save_shader_cost(state);
+    
+    //The undersample factor is chosen so that a frame takes the configured delay
+    //while the governor may space frames further apart to save power.
+    //GPU time is used where it is known since it is what undersampling reduces.
+    //Tiled frames are judged by what the whole frame would cost.
+    float dest = frame_delay / 1000.0f;
+    float current = (state->gpu_time ? state->gpu_time : state->time_delta) / 1000000.0f;
+    if (state->tile_size) current = state->pixel_cost * fb_width * fb_height / 1000000.0f;
     
-    float dest = mi->pause / 1000.0f;
-    float current = state->time_delta / 1000000.0f;
+    //Shaders that are only drawn once are drawn at full resolution and the
+    //resolution is not changed in the middle of a tiled pass.
+    if (state->time_invariant || state->tile_index) goto no_reshape;
     
+    //The factors stop growing at the maximum so that coming back down does not
+    //have to unwind steps that never had an effect.
+    float max = get_undersample_max();
     float* undersample = state->undersamples + state->frame_count%4;
-    if (current > (dest+1.0f)) *undersample += 0.1f;
+    if (current>(dest+1.0f) && state->undersample<max) *undersample += 0.1f;
     else if (current<(dest-1.0f) && state->undersample>1.0f) *undersample -= 0.1f;
     else goto no_reshape;
     
     state->undersample = (state->undersamples[0]+state->undersamples[1]+
                           state->undersamples[2]+state->undersamples[3]) / 2.0f;
-    state->undersample = state->undersample>undersample_max ? undersample_max:state->undersample;
+    state->undersample = state->undersample>max ? max : state->undersample;
     reshape_wip24(mi, MI_WIDTH(mi), MI_HEIGHT(mi));
     no_reshape:
         ;
     
-    mi->pause = dest>current ? dest-current : 0;
+    schedule_next_frame(mi, state, frame_start);
     
     if ((get_time() - state->start_time)/1000000000.0f > shader_duration)
         init_shader(mi, state);